@@ -0,0 +1,64 @@
+/*
+ * Device.h
+ *
+ * Compile-time device profiles, one is selected by a build define:
+ *  XC8 -DDEVICE_PIC16F1789, sim: make DEVICE=PIC16F1789 (default PIC16F1783)
+ *
+ * Everything that depends on the part follows from the profile: row size,
+ * flash size, bootloader region, runApp()/bootLoad() addresses and the INFO
+ * block. The linker range is the one thing to set by hand, the application
+ * space must be kept out of the bootloader build:
+ *  --ROM=default,-7-<BOOT_START-1>     (listed with each profile)
+ */
+#ifndef DEVICE_H
+#define DEVICE_H
+
+/******************************************************************************
+ * Profiles
+ *
+ *  part                    flash words  row words  EEPROM bytes  --ROM
+ *  PIC16F1783, PIC16F1784      4096         32         256        -7-dff
+ *  PIC16F1786, PIC16F1787      8192         32         256        -7-1dff
+ *  PIC16F1788, PIC16F1789     16384         32         256        -7-3dff
+ *  DEVICE_CUSTOM           FLASH_WORDS, FLASH_ROWSIZE, EEPROM_SIZE given
+ *                          as build defines, e.g. 64-word row parts
+ */
+#if defined( DEVICE_PIC16F1788) || defined( DEVICE_PIC16F1789)
+#define FLASH_WORDS     16384
+#define FLASH_ROWSIZE   32
+#define EEPROM_SIZE     256
+
+#elif defined( DEVICE_PIC16F1786) || defined( DEVICE_PIC16F1787)
+#define FLASH_WORDS     8192
+#define FLASH_ROWSIZE   32
+#define EEPROM_SIZE     256
+
+#elif defined( DEVICE_CUSTOM)
+#if !defined( FLASH_WORDS) || !defined( FLASH_ROWSIZE) || !defined( EEPROM_SIZE)
+#error "DEVICE_CUSTOM needs FLASH_WORDS, FLASH_ROWSIZE and EEPROM_SIZE"
+#endif
+
+#else   // PIC16F1783, PIC16F1784
+#define FLASH_WORDS     4096
+#define FLASH_ROWSIZE   32
+#define EEPROM_SIZE     256
+#endif
+
+/******************************************************************************
+ * Derived
+ */
+#define FLASH_SIZE      ( FLASH_WORDS*2UL)          // bytes, as INFO reports it
+#define FLASH_ROWMASK   ( FLASH_ROWSIZE-1)
+#define FLASH_PAGEMASK  0x7FF                       // goto range, PAGESEL the rest
+
+#ifndef BOOT_SIZE
+#define BOOT_SIZE       0x200                       // words, top of flash, --ROM to match
+#endif
+#define BOOT_START      ( FLASH_WORDS-BOOT_SIZE)    // row aligned high start of bootloader
+#define APP_START       ( BOOT_START-2)             // ljmp to application
+
+#if ( FLASH_ROWSIZE & FLASH_ROWMASK) || ( BOOT_SIZE % FLASH_ROWSIZE)
+#error "FLASH_ROWSIZE must be a power of 2, BOOT_SIZE whole rows"
+#endif
+
+#endif // DEVICE_H
@@ -33,6 +33,7 @@ unsigned FLASH_read( unsigned address)
     // 1. load the address pointers
     EEADR = address;
     EECON1bits.CFGS = 0;    // select the flash address space
+    EECON1bits.EEPGD = 1;   // program flash, not data EEPROM (178x!!!)
     EECON1bits.RD = 1;      // next operation will be a read
     NOP();
     NOP();
@@ -42,7 +43,7 @@ unsigned FLASH_read( unsigned address)
 } // FLASH_read
 
 
-void FLASH_readBlock( unsigned *buffer, unsigned address, char count)
+void FLASH_readBlock( unsigned *buffer, unsigned address, unsigned count)
 {
     while ( count > 0)
     {
@@ -57,6 +58,9 @@ void FLASH_readBlock( unsigned *buffer, unsigned address, char count)
  */
 void _unlock( void)
 {
+#ifdef SIM
+    sim_unlock();
+#else
     #asm
         BANKSEL     EECON2
         MOVLW       0x55
@@ -67,6 +71,7 @@ void _unlock( void)
         NOP
         NOP
     #endasm
+#endif
 } // unlock
 
 
@@ -120,4 +125,60 @@ void FLASH_erase( unsigned address)
 } // FLASH_erase
 
 
+/******************************************************************************
+ * Data EEPROM functions
+ */
+
+uint8_t EEPROM_read( uint8_t address)
+{
+    // 1. load the address pointers
+    EEADR = address;
+    EECON1bits.CFGS = 0;    // deselect the config space
+    EECON1bits.EEPGD = 0;   // select the data EEPROM
+    EECON1bits.RD = 1;      // next operation will be a read
+    NOP();
+    NOP();
+
+    // 2. return value read
+    return EEDAT;
+} // EEPROM_read
+
+
+void EEPROM_start( uint8_t address, uint8_t data)
+{
+    // 1. disable interrupts (remember setting)
+    char temp = INTCONbits.GIE;
+    INTCONbits.GIE = 0;
+
+    // 2. load the address pointers
+    EEADR = address;
+    EEDAT = data;
+    EECON1bits.CFGS = 0;    // deselect the config space
+    EECON1bits.EEPGD = 0;   // select the data EEPROM
+    EECON1bits.WREN = 1;    // enable data EEPROM write
+
+    // 3. perform unlock sequence, the CPU keeps running during the write
+    _unlock();
+
+    // 4. disable writes (the one started goes on) and restore interrupts
+    EECON1bits.WREN = 0;
+    if ( temp)
+        INTCONbits.GIE = 1;
+
+} // EEPROM_start
+
+
+uint8_t EEPROM_busy( void)
+{
+    return EECON1bits.WR;   // cleared by the hardware when done
+} // EEPROM_busy
+
+
+void EEPROM_write( uint8_t address, uint8_t data)
+{
+    EEPROM_start( address, data);
+    while( EEPROM_busy());  // ~4ms
+} // EEPROM_write
+
+
 
@@ -3,11 +3,9 @@
  *
  * Updated on November 4, 2014
  */
-#define FLASH_SIZE      8192        // 8K bytes
+#include <stdint.h>
 
-#define FLASH_ROWSIZE   32          // size of a row in words
-
-#define FLASH_ROWMASK     FLASH_ROWSIZE-1   
+#include "Device.h"                 // FLASH_SIZE, FLASH_ROWSIZE, EEPROM_SIZE
 
 /******************************************************************************
  * Generic Flash functions
@@ -37,7 +35,7 @@ unsigned FLASH_readConfig( unsigned address);
  * @param address   source address (absolute FLASH memory address)
  * @param count     number of words to be retrieved
  */
-void    FLASH_readBlock( unsigned* buffer, unsigned address, char count);
+void    FLASH_readBlock( unsigned* buffer, unsigned address, unsigned count);
 
 
 /**
@@ -59,3 +57,43 @@ void    FLASH_write( unsigned address, unsigned data, char latch);
 void    FLASH_erase( unsigned address);
 
 
+/******************************************************************************
+ * Data EEPROM functions
+ */
+
+/**
+ * Read a byte from data EEPROM
+ *
+ * @param address   source address (0..EEPROM_SIZE-1)
+ * @return          byte retrieved from data EEPROM
+ */
+uint8_t EEPROM_read( uint8_t address);
+
+
+/**
+ * Write a byte to data EEPROM (erase and write), waits for completion
+ *
+ * @param address   destination address (0..EEPROM_SIZE-1)
+ * @param data      byte to be written
+ */
+void    EEPROM_write( uint8_t address, uint8_t data);
+
+
+/**
+ * Start writing a byte to data EEPROM (erase and write), returns at once,
+ * the CPU keeps running while the write completes (~4ms)
+ *
+ * @param address   destination address (0..EEPROM_SIZE-1)
+ * @param data      byte to be written
+ */
+void    EEPROM_start( uint8_t address, uint8_t data);
+
+
+/**
+ * Check for a data EEPROM write in progress
+ *
+ * @return          non zero until the last write completes
+ */
+uint8_t EEPROM_busy( void);
+
+
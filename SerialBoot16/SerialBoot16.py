@@ -7,8 +7,12 @@
 #
 import serial
 import serial.tools.list_ports as lp
+import os
 import time
 import sys
+import threading
+import getopt
+import json
 import intelhex
 from Tkinter import *
 from tkFileDialog import askopenfilename
@@ -22,6 +26,65 @@ cmdBOOT     =  'B' #3
 cmdREBOOT   =  'R' #4
 cmdWRITE    =  'W' #11
 cmdERASE    =  'E' #21
+cmdWRITEW   =  'P' #12
+cmdSTATS    =  'T' #13
+cmdBAUD     =  'U' #14
+cmdCRC      =  'C' #15
+cmdREAD     =  'D' #16
+cmdHASH     =  'H' #17
+cmdNODE     =  'A' #18
+cmdVALID    =  'V' #19
+cmdCHECK    =  'K' #20
+cmdEEWRITE  =  'M' #21
+cmdEEREAD   =  'N' #22
+cmdIDENT    =  'G' #23
+
+# Bootloader capabilities (INFO field 9)
+capWRITEW   = 0x0001    # windowed write supported
+capSTATS    = 0x0002    # statistics supported
+capBAUD     = 0x0004    # baud rate change supported
+capERASEW   = 0x0008    # erase and write supported
+capERASEN   = 0x0010    # erase ERASE_BLOCK_COUNT rows supported
+capCRC      = 0x0020    # range CRC supported
+capREAD     = 0x0040    # flash read supported
+capHASH     = 0x0080    # row digest table supported
+capPACK     = 0x0100    # packed write data supported
+capRLE      = 0x0200    # run length encoded data supported
+capBUS      = 0x0400    # 9-bit addressed bus supported
+capVALID    = 0x0800    # application valid marker supported
+capCHECK    = 0x1000    # resume checkpoint supported
+capEEPROM   = 0x2000    # data EEPROM write/read supported
+capIDENT    = 0x4000    # device identification supported
+
+BROADCAST   = 0x00      # bus address of all the nodes
+
+WR_ERASE    = 0x8000    # DATA_LEN flag, erase the row before writing
+WR_PACKED   = 0x4000    # DATA_LEN flag, 14-bit words packed 4 in 7 bytes
+WR_RLE      = 0x2000    # DATA_LEN flag, run length encoded words
+
+Window      = 4         # windowed write: max rows in flight
+WriteStall  = 0.0025    # self-write stall (s), receiver overruns meanwhile
+EraseStall  = 0.0025    # row erase stall (s)
+LatchTime   = 0.0002    # loading the row latches (s), before the write stall
+EraseChunk  = 32        # rows per range erase command
+VerifyChunk = 8         # rows per CRC, mismatches are narrowed to rows
+EEBase      = 0x1E000   # hex file address of the data EEPROM (word 0xF000)
+EESize      = 256       # data EEPROM bytes
+EEReserved  = 0xF8      # bootloader locations from here up (see main.c)
+EEBurst     = 64        # bytes per EEPROM write command (EE_BURST)
+EEWriteTime = 0.005     # s, max per EEPROM byte write
+
+BaudDefault = 19200     # connection and fall back rate
+WakeUp      = None      # sent to the application to request boot mode (-e)
+WakeDelay   = 0.1       # s, for the application to reset
+FleetTries  = 10        # connect and sync attempts per fleet port, then failed
+Profiles    = os.path.join( os.path.expanduser( '~'), '.serialboot16.json')
+                        # INFO cache by device ID (None = always INFO, -i)
+BaudTimeout = 1.0       # device waits this long (s) for a SYNC at a new rate
+BaudSync    = 0.2       # s per SYNC try at a new rate, 4 fit in BaudTimeout
+BaudError   = 2.5       # max baud rate error (%)
+Bauds       = [ 19200, 38400, 57600, 115200, 125000, 230400, 250000,
+                460800, 500000, 1000000, 2000000]
 
 """
 Protocol Description.
@@ -60,8 +123,161 @@ Protocol Description.
     | Restart MCU              |                  <STX><cmdREBOOT>                 |
     | Write to MCU flash       | <STX><cmdWRITE><START_ADDR><DATA_LEN><DATA_ARRAY> |
     | Erase MCU flash.         |  <STX><cmdERASE><START_ADDR><ERASE_BLOCK_COUNT>   |
+    | Windowed write to flash  | <STX><cmdWRITEW><SEQ><START_ADDR><DATA_LEN>       |
+    |                          |                       <DATA_ARRAY><CHECKSUM>      |
+    | Send statistics          |                  <STX><cmdSTATS>                  |
+    | Change baud rate         |                <STX><cmdBAUD><BRG>                |
+    | CRC of a flash range     |           <STX><cmdCRC><START_ADDR><COUNT>        |
+    | Read flash               |           <STX><cmdREAD><START_ADDR><COUNT>       |
+    | Row digest table         |           <STX><cmdHASH><START_ADDR><COUNT>       |
+    | Set bus node address     |        <STX><cmdNODE><NODE><GROUP><CHECK>         |
+    | Mark application valid   |               <STX><cmdVALID><VALID>              |
+    | Update checkpoint        |            <STX><cmdCHECK><ID><START>             |
+    | Write data EEPROM        |  <STX><cmdEEWRITE><START_ADDR><COUNT><DATA_ARRAY> |
+    | Read data EEPROM         |          <STX><cmdEEREAD><START_ADDR><COUNT>      |
+    | Identify the device      |                  <STX><cmdIDENT>                  |
      ------------------------------------------------------------------------------ 
+
+    * Windowed write.
+
+    The host can keep several cmdWRITEW frames in flight without waiting for
+    each acknowledge. SEQ is a modulo 256 row sequence number (reset to 0 by
+    cmdSYNC), CHECKSUM makes the byte sum of SEQ..CHECKSUM equal to zero.
+    A frame is written only if its checksum is good and SEQ is the next one
+    expected, otherwise it is dropped. Every frame is acknowledged with the
+    SEQ of the last row written in order (cumulative acknowledge), so the
+    host resends everything after it (go back N). The host pads each frame
+    with idle (non STX) bytes covering the self-write stall, as the receiver
+    overruns while the CPU is halted.
      
+    * Packed data.
+
+    Setting WR_PACKED (0x4000) in DATA_LEN sends DATA_ARRAY as a little
+    endian bit stream of 14-bit words, word n in bits 14n..14n+13, padded to
+    a whole byte: 4 words take 7 bytes instead of 8.
+
+    * Run length encoded data.
+
+    Setting WR_RLE (0x2000) in DATA_LEN sends DATA_ARRAY as a sequence of
+    tokens, each one byte followed by words (lsb first), until DATA_LEN words
+    are expanded:
+        0x80 | (n-1), WORD              - repeat run, n copies of WORD
+        0x00 | (n-1), WORD[0..n-1]      - literal run, n words
+    The host uses it for a row only when it is shorter than the plain (or
+    packed) data.
+
+    * Variable length rows.
+
+    DATA_LEN may be less than the row size: the device latches the words
+    sent from START_ADDR and the last one commits the row, the rest stays
+    erased. The host leaves out the trailing blank (0x3FFF) words of each
+    row, keeping at least one so a frame without WR_ERASE is still a write.
+
+    * Erase.
+
+    cmdERASE erases ERASE_BLOCK_COUNT consecutive rows from the one containing
+    START_ADDR, stopping short of the bootloader, then acknowledges once.
+
+    * Erase and write.
+
+    Setting WR_ERASE (0x8000) in the DATA_LEN field of cmdWRITE or cmdWRITEW
+    erases the row containing START_ADDR before programming DATA_ARRAY, with
+    a single acknowledge. DATA_LEN may be 0 (erase only). Used when INFO
+    reports capERASEW and erase blocks and write rows match.
+
+    * CRC.
+
+    cmdCRC returns the CRC-16 (CCITT polynomial 0x1021, seed 0xFFFF) of COUNT
+    words of program memory from START_ADDR, each 14-bit word fed lsb first,
+    so the host can verify a range without reading it back.
+    cmdHASH streams the same CRC for each of COUNT rows from the one containing
+    START_ADDR, the digest table the host compares to a new image to erase
+    and write only the rows that changed (delta flashing).
+
+    * Read.
+
+    cmdREAD streams COUNT words (lsb first) of program memory from START_ADDR
+    right after the acknowledge, with no further handshake, any range up to
+    the whole flash.
+
+    * Data EEPROM.
+
+    The data EEPROM bytes of the hex file (one per word from 0xF000, byte
+    address EEBase) are written after the application verified, EEBurst
+    bytes per cmdEEWRITE, then read back with cmdEEREAD and compared. The
+    device writes each byte while receiving the next ones and skips those
+    unchanged. Bytes missing from the hex file are left alone, those of the
+    bootloader (EEReserved up) are never written. Reading a device (-r)
+    saves its data EEPROM too.
+
+    * Identification.
+
+    INFO field 2 (MCUID) is the device ID word of the configuration space,
+    device in bits 13..5, revision in bits 4..0. The decoded INFO of each
+    device ID and layout is kept in Profiles, once such a device is met
+    again cmdIDENT (ID, bootloader revision, CAPS, BOOT_START and row size)
+    replaces INFO when all of them match the cached ones. The layout is part
+    of the key: bootloaders built with another BOOT_SIZE share the device ID.
+    An older bootloader restarts on cmdIDENT, the host then syncs again and
+    falls back to INFO.
+
+    * Baud rate change.
+
+    BRG is the 16-bit baud rate generator divisor, baud = Fosc/(4*(BRG+1)),
+    computed by the host from the INFO oscillator frequency. The device
+    acknowledges at the current rate, switches, then waits BAUD_TIMEOUT ms
+    for a <STX><cmdSYNC> at the new rate (acknowledged at the new rate).
+    If none arrives it falls back to 19200 baud, where the host syncs again.
+    The host syncs within the device wait, then (the ack may have been lost)
+    tries the new rate again and 19200, a bounded number of times each.
+    See BaudTable() for the rates a given Fosc can hit.
+
+    * Application valid marker.
+
+    The device runs the application at reset only if it is marked valid
+    (data EEPROM), so an interrupted update leaves it in boot mode. The
+    device clears the mark at the first erase or write, the host clears it
+    with cmdVALID (VALID = 0) before, outside the windowed stream, and sets
+    it (VALID = 1) once the image verified.
+
+    * Application request.
+
+    An application can ask for boot mode by writing 0xB0 to data EEPROM
+    address 0xFC and resetting itself, the device then stays in boot mode
+    until the session ends with cmdREBOOT. With -e the host sends the
+    application its own command (at BaudDefault) to do so once connected.
+
+    * Resume.
+
+    The device counts the rows written since cmdCHECK (START = 1) began an
+    image, ID being the CRC of the application range of the hex file, and
+    keeps the count in data EEPROM (saved once the line is idle). With -c
+    the host queries it (START = 0): for the same image it skips the erase
+    and the rows already written, the rest goes as usual, otherwise the
+    update starts over. The count may be short after a power loss, never
+    long, the rows in between are written again.
+    A delta update (-d) writes another row sequence, its ID is the CRC
+    complemented. Resuming one runs delta again from the start: the rows
+    written before already match and drop out of the changed ones.
+
+    * Statistics.
+
+    cmdSTATS returns receive counters, the row erase and write stall times
+    (count, last, longest) and, for each command, <CMD_CODE><count><longest>,
+    all measured by the device TMR1 in us (see main.c), see dStats.
+
+    * Multi-drop bus (RS-485).
+
+    A device whose data EEPROM holds a node address runs the EUSART in 9-bit
+    mode, the host uses space parity for data and sends an address byte with
+    mark parity to select the node(s) receiving the following commands:
+    NODE (answers as usual), GROUP or 0x00 (broadcast, all execute, none
+    answers). Broadcast cmdWRITEW frames are written whatever their SEQ, so
+    Bus() streams the rows once, then checks and repairs each node in turn.
+    cmdNODE sets NODE and GROUP (1..0xFE, 0xFF = none), from the next reset.
+    CHECK makes the sum of NODE, GROUP and CHECK zero, the device stores a
+    checked pair only and answers with both read back.
+
      * Acknowledge format.
    
     <STX[0]><CMD_CODE[0]>
@@ -85,13 +301,32 @@ Protocol Description.
     | Restart MCU              |                  no acknowledge                   |
     | Write to MCU flash       | upon each write of internal buffer data to flash  |
     | Erase MCU flash.         |                  upon execution                   |
+    | Windowed write to flash  |     <STX><cmdWRITEW><SEQ> upon each frame         |
+    | Send statistics          | upon reception, then <COUNT><WORD[0..COUNT-1]>    |
+    | Change baud rate         |    upon reception (old rate), then SYNC (new)     |
+    | CRC of a flash range     |            upon reception, then <CRC>             |
+    | Read flash               |      upon reception, then <DATA[0..COUNT-1]>      |
+    | Row digest table         |      upon reception, then <CRC[0..COUNT-1]>       |
+    | Set bus node address     |       upon execution, then <NODE><GROUP>          |
+    | Mark application valid   |                  upon execution                   |
+    | Update checkpoint        |       upon execution, then <ID><ROWS>             |
+    | Write data EEPROM        |                  upon execution                   |
+    | Read data EEPROM         |      upon reception, then <DATA[0..COUNT-1]>      |
+    | Identify the device      |  upon reception, then <ID><REV><CAPS><BOOT><ROW>  |
    
 """
+# Statistics block, word index -> description, then the commands
+# (code, count, longest us) up to the end of the block
+dStats = [ 'RX overruns', 'RX framing errors', 'RX bytes', 'RX OERR events',
+           'Row erases', 'Last erase (us)', 'Longest erase (us)',
+           'Row writes', 'Last write (us)', 'Longest write (us)']
+
 # Supported MCU families/types.
 dMcuType = { "PIC16" : 1, 'PIC18':2, 'PIC18FJ':3, 'PIC24':4, 'dsPIC':10, 'PIC32': 20}
 
-#define an INFO record
-class info:
+#define an INFO record, the session state of one device:
+#   each thread flashing a device sees its own copy (see Fleet)
+class Session( threading.local):
     McuType = ''
     McuId = 0
     McuSize = 0
@@ -100,8 +335,14 @@ class info:
     BootloaderRevision = 0
     DeviceDescription = ''
     BootStart = 0
+    Caps = 0
+    Fosc = 0
     # additional fields 
     dHex = None
+    h = None                # serial port
+    io = None               # transfer engine
+
+info = Session()            # the current thread's device
 
 
 def getMCUtype( list, i):
@@ -114,9 +355,9 @@ def getMCUtype( list, i):
     return i+1
 
 def getMCUid( list, i):
-    # MCUId appears not to be used anymore, report error
-    print 'MCUId Info field found!?'
-    exit(1)   
+    info.McuId = ( int(list[i+0])+int(list[i+1])*256)
+    print "MCU ID = 0x%04x, revision %d" % ( info.McuId & 0x3fe0, info.McuId & 0x1f)
+    return i+1
 
 def getMCUSIZE( list, i):
     low  = int(list[i+0]) + int(list[i+1])*256
@@ -147,22 +388,36 @@ def getBOOTS( list, i):
     print "BOOT Start = 0x%x" % info.BootStart
     return i+3
 
+def getCAPS( list, i):
+    info.Caps = ( int(list[i+0])+int(list[i+1])*256)
+    print "Capabilities = 0x%x" % info.Caps
+    return i+1
+
+def getFOSC( list, i):
+    low  = int(list[i+0]) + int(list[i+1])*256
+    high = int(list[i+2]) + int(list[i+3])*256
+    info.Fosc = (high*65536 + low)
+    print "Fosc = %d Hz" % info.Fosc
+    return i+3
+
 def getDEVDSC( list, i):
     info.DeviceDescription = "".join(map( lambda x: chr(x), list[i : i+20]))
     #print "Device Description: %s" % info.DeviceDescription
-    return i+20
+    return i+19
 
 # Bootloader info field ID's enum 
 dBIF = { 
         # 0: ("ALIGN", skip_align),
         1: ('MCUTYPE', getMCUtype),   # MCU type/family (byte)
-        2: ('MCUID',   getMCUid  ),   # MCU ID number ()
+        2: ('MCUID',   getMCUid  ),   # MCU ID and revision (int)
         3: ('ERASEBLOCK', getERASEB), # MCU flash erase block size (int)
         4: ('WRITEBLOCK', getWRITEB), # MCU flash write block size (int)
         5: ('BOOTREV',    getBOOTR),  # Bootloader revision (int)
         6: ('BOOTSTART',  getBOOTS),  # Bootloader start address (long)
         7: ('DEVDSC',     getDEVDSC), # Device descriptor (string[20])
-        8: ('MCUSIZE',    getMCUSIZE) # MCU flash size (long)
+        8: ('MCUSIZE',    getMCUSIZE),# MCU flash size (long)
+        9: ('CAPS',       getCAPS),   # Bootloader capabilities (int)
+       10: ('FOSC',       getFOSC)    # Oscillator frequency, Hz (long)
         }
    
 def DecodeINFO( size, list):
@@ -180,96 +435,771 @@ def DecodeINFO( size, list):
         index += 1
 
 #----------------------------------------------------------------------
-def Connect():
-    global h
-    portgen = lp.grep( 'tty.usb')
-    for port,_,_ in portgen: break      # catch the first one
+# Transfer engine
+#   a reader thread parses the device responses while the caller keeps
+#   sending commands, requests complete in order (callback) on their response
+#   or when their deadline expires
+
+Timeout     = 1.0       # response deadline (s), on top of the wire time
+Poll        = 0.02      # reader thread polling period (s)
+Settle      = 0.01      # line idle before a parity change (s), adapters buffer
+
+class ProtocolError( Exception): pass
+class ConnectionFailed( Exception): pass
+
+class Trace:
+    # wire trace (-t), one JSON record per line:
+    #   t       time (s) since the trace started, never decreasing
+    #   port    serial port
+    #   ev      open (baud), tx/rx (data, hex), cmd (request submitted,
+    #           cmd, need), done (cmd, error), baud, parity, flush, close
+    def __init__( self, name):
+        self.f = open( name, 'w')
+        self.lock = threading.Lock()
+        self.start = time.time()
+        self.last = 0
+
+    def log( self, port, ev, **kw):
+        with self.lock:
+            self.last = max( self.last, time.time() - self.start)
+            kw.update( t=round( self.last, 6), port=port, ev=ev)
+            self.f.write( json.dumps( kw, sort_keys=True) + '\n')
+            self.f.flush()          # all of it, if the session dies
+
+trace = None                        # Trace, when recording
+
+class Request:
+    def __init__( self, cmd, need, timeout, callback):
+        self.cmd = cmd              # acknowledge expected, None: raw response
+        self.need = need            # payload size, or f( payload so far)
+        self.timeout = timeout
+        self.start = time.time()
+        self.deadline = self.start + timeout
+        self.callback = callback    # f( request), in the reader thread
+        self.reply = None           # payload (bytearray)
+        self.error = None           # 'nak', 'timeout', 'flushed', 'closed'
+        self.done = threading.Event()
+
+    def size( self, payload):
+        if callable( self.need): return self.need( payload)
+        return self.need
+
+    def join( self):
+        # wait for completion (polling, so Ctrl-C still works)
+        while not self.done.is_set():
+            self.done.wait( Poll)
+        return self
+
+    def wait( self):
+        # wait for completion, return the payload
+        if self.join().error:
+            raise ProtocolError( "cmd %s: %s" % ( self.cmd, self.error))
+        return self.reply
+
+class Engine:
+    def __init__( self, port):
+        self.h = port
+        self.h.timeout = Poll
+        self.pending = []           # requests in flight, in order
+        self.buf = bytearray()      # received, not parsed yet
+        self.sent = 0               # bytes sent
+        self.idle = 0               # time the line is idle (all sent)
+        self.latency = None         # list of (command, s) completed, if set
+        self.lock = threading.Condition()
+        self.trace = trace
+        self.baud = port.baudrate   # line settings traced
+        self.parity = port.parity
+        self.log( 'open', baud=self.baud, parity=self.parity)
+        self.running = True
+        self.thread = threading.Thread( target=self.run)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def wire( self, n):
+        # time (s) n bytes take at the current baud rate (and parity)
+        bits = 10.0 if self.h.parity == serial.PARITY_NONE else 11.0
+        return n * bits / self.h.baudrate
+
+    def log( self, ev, **kw):
+        if self.trace:
+            self.trace.log( self.h.port, ev, **kw)
+
+    def write( self, data):
+        if self.trace:
+            if self.h.baudrate != self.baud:
+                self.baud = self.h.baudrate
+                self.log( 'baud', baud=self.baud)
+            if self.h.parity != self.parity:
+                self.parity = self.h.parity
+                self.log( 'parity', parity=self.parity)
+            self.log( 'tx', data=str( bytearray( data)).encode( 'hex'))
+        self.sent += len( data)
+        self.idle = max( self.idle, time.time()) + self.wire( len( data))
+        self.h.write( data)
+
+    def send( self, data):
+        # command without a response
+        self.write( data)
+
+    def settle( self):
+        # wait for everything sent to be out on the line
+        time.sleep( max( 0, self.idle - time.time()) + Settle)
+
+    def address( self, a):
+        # 9-bit bus: select the node(s) receiving the next commands with an
+        # address byte (mark parity), data bytes go with space parity
+        self.settle()
+        self.h.parity = serial.PARITY_MARK
+        self.write( bytearray([ a]))
+        self.settle()
+        self.h.parity = serial.PARITY_SPACE
+
+    def submit( self, data, cmd, need=0, timeout=Timeout, callback=None, limit=0):
+        # queue a request and send its command, wait first while
+        # limit requests are in flight
+        if not callable( need):
+            timeout += self.wire( len( data) + need)
+        r = Request( cmd, need, timeout, callback)
+        r.code = chr( data[1])      # command sent
+        self.log( 'cmd', cmd=r.code, need=None if callable( need) else need)
+        with self.lock:
+            while limit and len( self.pending) >= limit:
+                self.lock.wait( Poll)
+            self.pending.append( r)
+        self.write( data)
+        return r
+
+    def call( self, data, cmd, need=0, timeout=Timeout):
+        # send a command and wait for its response payload
+        return self.submit( data, cmd, need, timeout).wait()
+
+    def drain( self):
+        # wait for all the requests in flight
+        with self.lock:
+            while self.pending:
+                self.lock.wait( Poll)
+
+    def flush( self):
+        # fail the requests in flight, drop anything received
+        self.log( 'flush')
+        with self.lock:
+            done = self.fail( 'flushed')
+            self.h.flushInput()
+            self.buf = bytearray()
+        self.notify( done)
+
+    def close( self):
+        self.running = False
+        self.thread.join()
+        self.log( 'close')
+        with self.lock:
+            done = self.fail( 'closed')
+        self.notify( done)
+
+    def complete( self, error=None):
+        # head request done (lock held), the next one starts its deadline
+        r = self.pending.pop( 0)
+        r.error = error
+        self.log( 'done', cmd=r.code, error=error)
+        if self.latency is not None and not error:
+            self.latency.append(( r.code, time.time() - r.start))
+        if self.pending:
+            n = self.pending[0]
+            n.deadline = max( n.deadline, time.time() + n.timeout)
+        r.done.set()
+        self.lock.notifyAll()
+        return r
+
+    def fail( self, error):
+        return [ self.complete( error) for x in xrange( len( self.pending))]
+
+    def notify( self, done):
+        for r in done:
+            if r.callback: r.callback( r)
+
+    def parse( self):
+        # match the received bytes to the requests in flight
+        done = []
+        while self.pending:
+            r = self.pending[0]
+            head = 0
+            if r.cmd:
+                i = self.buf.find( STX)     # hunt for the acknowledge
+                if i < 0:
+                    self.buf = bytearray()
+                    break
+                del self.buf[:i]
+                if len( self.buf) < 2: break
+                if self.buf[1] != ord( r.cmd):
+                    del self.buf[:1]
+                    done.append( self.complete( 'nak'))
+                    continue
+                head = 2
+            n = r.size( self.buf[head:])
+            if len( self.buf) < head + n: break
+            r.reply = self.buf[head:head+n]
+            del self.buf[:head+n]
+            done.append( self.complete())
+        if not self.pending:
+            self.buf = bytearray()  # nothing expected, garbage
+        return done
+
+    def run( self):
+        while self.running:
+            try:
+                data = self.h.read( max( 1, self.h.inWaiting()))
+            except:
+                break               # port closed
+            if data:
+                self.log( 'rx', data=str( bytearray( data)).encode( 'hex'))
+            with self.lock:
+                self.buf.extend( data)
+                done = self.parse()
+                if self.pending and time.time() > self.pending[0].deadline:
+                    # out of step with the device, fail all in flight
+                    self.buf = bytearray()
+                    done += self.fail( 'timeout')
+            self.notify( done)
+
+def Connect( port=None):
+    if not port:
+        portgen = lp.grep( 'tty.usb')
+        for port,_,_ in portgen: break  # catch the first one
     print 'port=',port
     if port: 
-        h = serial.Serial( port, baudrate=19200)
-        print h
-        h.flushInput()
-    else: raise ConnectionFailed
-
-def ConnectLoop():
+        info.h = serial.Serial( port, baudrate=BaudDefault)
+        print info.h
+        info.h.flushInput()
+        info.io = Engine( info.h)   # all device I/O from here on
+    else: raise ConnectionFailed( 'no port')
+
+def ConnectLoop( port=None, tries=-1):
+    # until the port opens, at most tries times (-1 = no limit)
     print "Connecting..."
     while True:
         try:
-            Connect()    
+            Connect( port)
         except:
+            tries -= 1
+            if tries == 0:
+                raise ConnectionFailed( 'cannot open %s' % port)
             print "Reset board and keep checking ..."
             time.sleep(1)
         else:
             break;
     # succeeded, obtained a handle 
     print "Connected!"
+    if WakeUp:                      # ask the application for boot mode
+        print "Requesting boot mode ..."
+        info.io.send( bytearray( WakeUp))
+        time.sleep( WakeDelay)
 
 def Boot():
     print "Send the BOOT command ..", 
-    h.write( bytearray([ STX, cmdBOOT]))
-    r = h.read(2)
-    if r[1] == cmdBOOT:
-        print "Ready!"
+    info.io.call( bytearray([ STX, cmdBOOT]), cmdBOOT)
+    print "Ready!"
 
-def Sync():
+def Sync( retries=-1, timeout=0.5):
     print "Send the Sync command",
-    h.timeout=0.5     # temporarily set a max time for sync response
-    r =[]
-    while len(r)<2:
-        h.write( bytearray([ STX, cmdSYNC]))
-        r = h.read(2)
-        if len(r)<2:    # timeout detected
+    while retries != 0:
+        retries -= 1
+        try:                        # max time for sync response
+            info.io.call( bytearray([ STX, cmdSYNC]), cmdSYNC, timeout=timeout)
+        except ProtocolError:       # timeout detected
             print "timeout!"
-            h.flushInput()  # flush all the remaining garbage in the input buffer
-
-    h.timeout = None    # wait forever
-    if r[1] == cmdSYNC:
-        print "Ready!"
+            info.io.flush()              # flush all the remaining garbage in the input buffer
+        else:
+            print "Ready!"
+            return True
+    print "failed!"
+    return False
 
 def Info():
     print "Send the INFO command",
-    h.write( bytearray([ STX, cmdINFO]))
-    size = ord(h.read())   # get the info block length
+    r = info.io.call( bytearray([ STX, cmdINFO]), None,
+                 lambda p: 1 + ( p[0] if p else 0))
+    size = r[0]            # get the info block length
     print "Size", size
-    ilist = bytearray(h.read( size))
+    ilist = r[1:]
     #print ilist
     DecodeINFO( size, ilist)
 
-def Erase( waddr):
+# INFO fields kept in the profile cache
+dProfile = [ 'McuType', 'McuId', 'McuSize', 'WriteBlock', 'EraseBlock',
+             'BootloaderRevision', 'DeviceDescription', 'BootStart', 'Caps', 'Fosc']
+ProfileLock = threading.Lock()  # Fleet threads share the file
+
+def LoadProfiles():
+    try:
+        return json.load( open( Profiles))
+    except ( IOError, ValueError):
+        return {}
+
+def ProfileKey( mcuid, bootstart, row):
+    # device ID and flash layout, BOOT_SIZE is a build option
+    return '%04x-%04x-%d' % ( mcuid, bootstart, row)
+
+def SaveProfile():
+    # add the current device to the cache
+    with ProfileLock:
+        profiles = LoadProfiles()
+        profiles[ ProfileKey( info.McuId, info.BootStart, info.WriteBlock)] = dict(( k, getattr( info, k)) for k in dProfile)
+        try:
+            json.dump( profiles, open( Profiles, 'w'), indent=1, sort_keys=True)
+        except IOError:
+            pass
+
+def Ident():
+    # device ID, bootloader revision, capabilities, boot start and row size
+    print "Send the IDENT command",
+    d = info.io.call( bytearray([ STX, cmdIDENT]), cmdIDENT, 10)
+    return [ d[x] + d[x+1]*256 for x in xrange( 0, 10, 2)]
+
+def Identify():
+    # the device infos, from the cache when the device type is known
+    with ProfileLock:
+        profiles = LoadProfiles() if Profiles else {}
+    if profiles:
+        try:
+            mcuid, rev, caps, bootstart, row = Ident()
+        except ProtocolError:
+            # an older bootloader jumps to its own start on an unknown
+            # command (bootLoad()), main() runs again from the reset checks:
+            # it answers SYNC at once, unless CS is released and the
+            # application valid, then only the wake-up text (-e) gets it back
+            print "failed!"
+            info.io.flush()
+            ok = Sync( 4)
+            if not ok and WakeUp:
+                print "Requesting boot mode ..."
+                info.io.send( bytearray( WakeUp))
+                time.sleep( WakeDelay)
+                info.io.flush()
+                ok = Sync( 4)
+            if not ok:
+                raise ProtocolError( 'no answer after IDENT (older bootloader running the application?)')
+        else:
+            p = profiles.get( ProfileKey( mcuid, bootstart, row))
+            if p and p[ 'BootloaderRevision'] == rev and p[ 'Caps'] == caps \
+                 and p[ 'BootStart'] == bootstart and p[ 'WriteBlock'] == row:
+                for k in dProfile:
+                    setattr( info, k, p[ k])
+                print "0x%04x, cached" % mcuid
+                return
+            print "0x%04x, not cached" % mcuid
+    Info()
+    if Profiles and info.Caps & capIDENT:
+        SaveProfile()
+
+def Stats():
+    print "Send the STATS command",
+    r = info.io.call( bytearray([ STX, cmdSTATS]), cmdSTATS,
+                 lambda p: 1 + ( p[0]*2 if p else 0))
+    count = r[0]                    # number of words
+    d = r[1:]
+    print "Ready!"
+    words = [ d[x] + d[x+1]*256 for x in xrange( 0, count*2, 2)]
+    for x in xrange( min( count, len( dStats))):
+        print "%s = %d" % ( dStats[x], words[x])
+    cmds = words[ len( dStats):]
+    if cmds:
+        print "Command  count  longest (us)"
+    for x in xrange( 0, len( cmds) - 2, 3):
+        if cmds[x+1]:                   # received at least once
+            longest = '%d' % cmds[x+2] if cmds[x+2] < 0xffff else '>65535'
+            print "   %s    %5d  %s" % ( chr( cmds[x]), cmds[x+1], longest)
+    return words
+
+def BaudTable( fosc):
+    # list of (baud, BRG, actual baud, error %) the device can hit
+    table = []
+    for baud in Bauds:
+        brg = int( round( fosc / 4.0 / baud)) - 1
+        if brg < 0 or brg > 0xffff: continue
+        actual = fosc / 4.0 / ( brg+1)
+        error = ( actual - baud) * 100.0 / baud
+        if abs( error) <= BaudError:
+            table.append( ( baud, brg, actual, error))
+    return table
+
+def PrintBaudTable( fosc):
+    print "Rates within %.1f%% at Fosc = %d Hz:" % ( BaudError, fosc)
+    print "   baud    BRG    actual   error"
+    for baud, brg, actual, error in BaudTable( fosc):
+        print "%7d  %5d  %8.0f  %+5.2f%%" % ( baud, brg, actual, error)
+
+def SetBaud( baud):
+    # switch both sides to a new rate, fall back to BaudDefault on failure
+    brg = [ e[1] for e in BaudTable( info.Fosc) if e[0] == baud]
+    if not brg:
+        print "Baud rate %d not available" % baud
+        PrintBaudTable( info.Fosc)
+        return False
+    print "Send the BAUD command (%d)" % baud,
+    cmd = bytearray([ STX, cmdBAUD])
+    cmd = extend16bit( cmd, brg[0])
+    info.io.call( cmd, cmdBAUD)
+    print "Ready!"
+    time.sleep( 0.01)               # let the device switch
+    start = time.time()
+    info.h.baudrate = baud
+    info.io.flush()
+    if Sync( 4, BaudSync):          # within the device wait
+        return True
+    # the device fell back, or synced and its ack was lost: once its wait
+    # is over, it answers at one of the two rates
+    time.sleep( max( 0, start + BaudTimeout + 0.1 - time.time()))
+    info.io.flush()
+    if Sync( 2):
+        return True
+    print "Falling back to %d baud" % BaudDefault
+    info.h.baudrate = BaudDefault
+    info.io.flush()
+    if Sync( 4):
+        return False
+    raise ProtocolError( 'no sync at %d or %d baud' % ( baud, BaudDefault))
+
+def Crc16( crc, data):
+    # CRC-16 CCITT, same byte update as crc16() in the firmware
+    for b in data:
+        x = (( crc >> 8) ^ b) & 0xff
+        x ^= x >> 4
+        crc = (( crc << 8) ^ ( x << 12) ^ ( x << 5) ^ x) & 0xffff
+    return crc
+
+def HexCrc( waddr, count):
+    # CRC of the words the device should hold, as 14-bit words lsb first
+    d = info.dHex
+    data = bytearray()
+    for x in xrange( waddr*2, ( waddr+count)*2, 2):
+        data.extend( [ d[x], d[x+1] & 0x3f])
+    return Crc16( 0xffff, data)
+
+def CrcRequest( waddr, count):
+    # queue a CRC request, the device keeps receiving while computing
+    cmd = bytearray([ STX, cmdCRC])
+    cmd = extend32bit( cmd, waddr)  # starting address
+    cmd = extend16bit( cmd, count)  # no of words
+    r = info.io.submit( cmd, cmdCRC, 2)
+    r.waddr = waddr
+    r.count = count
+    return r
+
+def Crc( waddr, count):
+    r = CrcRequest( waddr, count).wait()
+    return r[0] + r[1]*256
+
+def Verify():
+    # compare the device and hex file CRCs of the application range,
+    # return the list of mismatched (start, end) word ranges
+    wwblk = info.WriteBlock
+    chunk = VerifyChunk * wwblk
+    bad = []
+    print "Verifying ..."
+    # all chunks in one go, then the rows of the failed ones
+    reqs = [ CrcRequest( waddr, min( chunk, info.BootStart - waddr))
+             for waddr in xrange( 0, info.BootStart, chunk)]
+    rows = []
+    for r in reqs:
+        d = r.wait()
+        if d[0] + d[1]*256 != HexCrc( r.waddr, r.count):
+            rows += [ CrcRequest( row, wwblk) for row in xrange( r.waddr, r.waddr+r.count, wwblk)]
+    for r in rows:
+        d = r.wait()
+        if d[0] + d[1]*256 != HexCrc( r.waddr, wwblk):
+            row = r.waddr
+            if bad and bad[-1][1] == row:
+                bad[-1] = ( bad[-1][0], row+wwblk)
+            else:
+                bad.append(( row, row+wwblk))
+    for start, end in bad:
+        print "Verify failed: 0x%04x-0x%04x" % ( start, end-1)
+    if not bad:
+        print "Verify OK"
+    return bad
+
+def Hash( waddr, count):
+    # digest table, the CRC of count rows starting at waddr
+    cmd = bytearray([ STX, cmdHASH])
+    cmd = extend32bit( cmd, waddr)  # starting address
+    cmd = extend16bit( cmd, count)  # no of rows
+    d = info.io.call( cmd, cmdHASH, count*2)
+    return [ d[x] + d[x+1]*256 for x in xrange( 0, count*2, 2)]
+
+def ChangedBlocks():
+    # erase blocks whose rows differ from the image, from the digest table
+    eblk = info.EraseBlock
+    wwblk = info.WriteBlock
+    nrows = info.BootStart / wwblk
+    table = Hash( 0, nrows)
+    blocks = []
+    for x in xrange( nrows):
+        b = x*wwblk / eblk
+        if table[x] != HexCrc( x*wwblk, wwblk) and b not in blocks:
+            blocks.append( b)
+    print "Delta: %d of %d blocks changed" % ( len( blocks), info.BootStart / eblk)
+    return blocks
+
+def Read( waddr, count):
+    # stream count words starting at waddr
+    cmd = bytearray([ STX, cmdREAD])
+    cmd = extend32bit( cmd, waddr)  # starting address
+    cmd = extend16bit( cmd, count)  # no of words
+    d = info.io.call( cmd, cmdREAD, count*2)
+    return [ d[x] + d[x+1]*256 for x in xrange( 0, count*2, 2)]
+
+def EEData():
+    # the data EEPROM bytes of the image, { address: byte}
+    d = info.dHex
+    return dict(( ( a - EEBase) / 2, d[a]) for a in d.addresses()
+                if EEBase <= a < EEBase + EESize*2 and a % 2 == 0)
+
+def EEWrite( addr, data):
+    # write a burst of data EEPROM bytes
+    cmd = bytearray([ STX, cmdEEWRITE])
+    cmd = extend32bit( cmd, addr)   # starting address
+    cmd = extend16bit( cmd, len( data))
+    cmd.extend( data)
+    info.io.call( cmd, cmdEEWRITE, timeout=Timeout + len( data) * EEWriteTime)
+
+def EERead( addr, count):
+    # stream count data EEPROM bytes starting at addr
+    cmd = bytearray([ STX, cmdEEREAD])
+    cmd = extend32bit( cmd, addr)   # starting address
+    cmd = extend16bit( cmd, count)  # no of bytes
+    return info.io.call( cmd, cmdEEREAD, count)
+
+def EEProgram():
+    # write and verify the data EEPROM bytes of the image,
+    # return the list of addresses that failed
+    ee = EEData()
+    if not ee:
+        return []
+    if not info.Caps & capEEPROM:
+        print "Data EEPROM not supported by this bootloader, %d bytes left out" % len( ee)
+        return []
+    if max( ee) >= EEReserved:
+        print "Data EEPROM 0x%02x-0x%02x reserved, left out" % ( EEReserved, EESize-1)
+        ee = dict(( a, b) for a, b in ee.items() if a < EEReserved)
+    print "Writing %d data EEPROM bytes ..." % len( ee)
+    addrs = sorted( ee)
+    x = 0
+    while x < len( addrs):              # runs of consecutive bytes
+        n = 1
+        while x+n < len( addrs) and addrs[x+n] == addrs[x]+n and n < EEBurst:
+            n += 1
+        EEWrite( addrs[x], [ ee[a] for a in addrs[x:x+n]])
+        x += n
+    d = EERead( 0, max( addrs)+1)
+    bad = [ a for a in addrs if d[a] != ee[a]]
+    for a in bad:
+        print "Data EEPROM verify failed: 0x%02x" % a
+    if not bad:
+        print "Data EEPROM verify OK"
+    return bad
+
+def Dump( name, waddr=0, count=None):
+    # save a flash range (default all of it) as an Intel HEX file,
+    # blank words are left out
+    if count is None:
+        count = info.McuSize/2 - waddr
+    print "Reading 0x%04x-0x%04x ..." % ( waddr, waddr+count-1)
+    words = Read( waddr, count)
+    d = intelhex.IntelHex()
+    for x in xrange( count):
+        if words[x] != 0x3fff:
+            d[ (waddr+x)*2]   = words[x] & 0xff
+            d[ (waddr+x)*2+1] = words[x] >> 8
+    if info.Caps & capEEPROM:
+        ee = EERead( 0, EESize)
+        for x in xrange( EESize):
+            if ee[x] != 0xff:
+                d[ EEBase + x*2] = ee[x]
+                d[ EEBase + x*2+1] = 0
+    d.tofile( name, format='hex')
+    print "Saved %d words to %s" % ( len(d)/2, name)
+
+def Erase( waddr, count=1):
     #print "Erase: 0x%x " % waddr
     cmd = bytearray([ STX, cmdERASE])
     cmd = extend32bit( cmd, waddr)  # starting address
-    cmd = extend16bit( cmd, 1)      # no of  words
-    h.write( cmd)               
-    r = h.read(2)                    # check reply
-    if r[1] != cmdERASE: raise ERASE_ERROR
+    cmd = extend16bit( cmd, count)  # no of blocks
+    info.io.call( cmd, cmdERASE, timeout=Timeout + count*EraseStall)
     
-def WriteRow( waddr):
-    # print "Write: 0x%x " % waddr
+def Pack( words):
+    # 14-bit words as a little endian bit stream, padded to a byte
+    out = bytearray()
+    bits = n = 0
+    for w in words:
+        bits |= ( w & 0x3fff) << n
+        n += 14
+        while n >= 8:
+            out.append( bits & 0xff)
+            bits >>= 8
+            n -= 8
+    if n > 0:
+        out.append( bits & 0xff)
+    return out
+
+def Rle( words):
+    # repeat runs of 2 or more words, literal runs in between
+    out = bytearray()
+    lit = []
+    i = 0
+    while i <= len( words):
+        r = 1
+        while i+r < len( words) and words[i+r] == words[i] and r < 128:
+            r += 1
+        if r >= 2 or i == len( words) or len( lit) == 128:
+            if lit:                 # close the literal run
+                out.append( len( lit)-1)
+                for w in lit: out.extend( [ w & 0xff, w >> 8])
+                lit = []
+        if i == len( words):
+            break
+        if r >= 2:
+            out.extend( [ 0x80 | ( r-1), words[i] & 0xff, words[i] >> 8])
+            i += r
+        else:
+            lit.append( words[i])
+            i += 1
+    return out
+
+def RowData( cmd, waddr, flags=0):
     iaddr = waddr*2                 # get the byte address
     count = info.WriteBlock         # number of words
-    cmd = bytearray([ STX, cmdWRITE])
-    cmd = extend32bit( cmd, waddr)
-    cmd = extend16bit( cmd, count)
+    if flags & WR_ERASE and EmptyRow( waddr):
+        count = 0                   # erase only
     d = info.dHex
     # pick count words out of the hex array
-    for x in xrange( iaddr, iaddr+count*2, 2):
-        cmd.extend( [ d[x], d[x+1]])
+    words = [ ( d[x] + d[x+1]*256) & 0x3fff for x in xrange( iaddr, iaddr+count*2, 2)]
+    while len( words) > 1 and words[-1] == 0x3fff:
+        words.pop()                 # erased tail, the last word left commits the row
+    count = len( words)
+    data = bytearray()
+    for w in words:
+        data.extend( [ w & 0xff, w >> 8])
+    # use the shortest encoding the device supports
+    if info.Caps & capPACK:
+        data = Pack( words)         # 4 words in 7 bytes
+        flags |= WR_PACKED
+    if info.Caps & capRLE and count > 0:
+        r = Rle( words)
+        if len( r) < len( data):
+            data = r
+            flags = ( flags & ~WR_PACKED) | WR_RLE
+    cmd = extend32bit( cmd, waddr)
+    cmd = extend16bit( cmd, count | flags)
+    cmd.extend( data)
+    return cmd
+
+def WriteRow( waddr, flags=0):
+    # print "Write: 0x%x " % waddr
+    cmd = RowData( bytearray([ STX, cmdWRITE]), waddr, flags)
     # print "cmd: ",cmd
-    h.write(cmd)                    # send the command
-    r = h.read(2)
-    if r[1] != cmdWRITE: raise WRITE_ERROR
+    info.io.call( cmd, cmdWRITE, timeout=Timeout + EraseStall + WriteStall)
+
+def WriteFrame( seq, waddr, flags=0):
+    # windowed write frame, checksum and idle padding covering the stall
+    cmd = RowData( bytearray([ STX, cmdWRITEW, seq & 0xff]), waddr, flags)
+    cmd.append( -sum( cmd[2:]) & 0xff)
+    stall = WriteStall
+    if flags & WR_ERASE:
+        stall = EraseStall
+        if not EmptyRow( waddr): stall += WriteStall
+    fill = int(( stall + LatchTime) * info.h.baudrate / 10) + 4    # + ack transmission
+    cmd.extend( [0] * fill)
+    return cmd
+
+def Progress( prev, done, total):
+    # report the rows written at each quarter of the job
+    if done * 4 / total > prev * 4 / total:
+        print "Written %d/%d rows" % ( done, total)
+
+def WriteWindow( rows, flags=0):
+    # keep up to Window rows in flight, go back N on a lost/rejected frame,
+    # the acks are collected while the next frames go out
+    base = 0                        # oldest row not acknowledged
+    Sync()                          # restart the device sequence from 0
+    while base < len( rows):
+        sent = []                   # frames in flight
+        next = base                 # next row to send
+        error = False
+        while sent or ( next < len( rows) and not error):
+            if next < len( rows) and not error:
+                r = info.io.submit( WriteFrame( next, rows[ next], flags), cmdWRITEW, 1,
+                               Timeout + EraseStall + WriteStall, limit=Window)
+                r.seq = next
+                sent.append( r)
+                next += 1
+                if not sent[0].done.is_set():
+                    continue        # keep the transmitter busy
+            r = sent.pop( 0).join()
+            if r.error:             # lost ack, out of step
+                error = True
+                continue
+            # cumulative ack: the last row written in order
+            n = ( r.reply[0] - base) & 0xff
+            if n < next - base:
+                Progress( base, base + n + 1, len( rows))
+                base += n + 1
+            if r.reply[0] != r.seq & 0xff:
+                error = True        # dropped frame
+        if error:
+            # all acks in, resend from base
+            print "WriteWindow: resend from row 0x%x" % rows[ base]
+            info.io.flush()
 
 def ReBoot():
-    # global h
     print "Rebooting the MCU!"
-    h.write(bytearray( [ STX, cmdREBOOT]))
+    info.io.send( bytearray( [ STX, cmdREBOOT]))
     Close()
 
+def Select( node):
+    # bus address of the node(s) receiving the next commands
+    info.io.address( node)
+
+def NodeValid( node):
+    # a node or group address, 0xff = none, never the broadcast address
+    return 0 < node <= 0xff
+
+def SetNode( node, group=0xff):
+    # store the bus addresses, in use from the next reset (0xff = none),
+    # return True once the device reads them back as sent
+    if not NodeValid( node) or not NodeValid( group):
+        print "Node and group must be 1..254 or 255 (none)"
+        return False
+    print "Send the NODE command (%d, %d)" % ( node, group),
+    d = info.io.call( bytearray([ STX, cmdNODE, node, group, -( node + group) & 0xff]),
+                      cmdNODE, 2, timeout=Timeout + 0.02)
+    if list( d) != [ node, group]:
+        print "failed, the device holds (%d, %d)" % ( d[0], d[1])
+        return False
+    print "Ready!"
+    return True
+
+def Validate( valid):
+    # set or clear the application valid marker (EEPROM write)
+    print "Send the VALID command (%d)" % valid,
+    info.io.call( bytearray([ STX, cmdVALID, 1 if valid else 0]), cmdVALID,
+                  timeout=Timeout + 0.01)
+    print "Ready!"
+
+def Checkpoint( image, start):
+    # begin counting the rows written for image (start), or just query,
+    # return the image and the rows written before the command
+    print "Send the CHECK command (0x%04x, %d)" % ( image, start),
+    d = info.io.call( bytearray([ STX, cmdCHECK, image % 256, image / 256,
+                                  1 if start else 0]), cmdCHECK, 4,
+                      timeout=Timeout + 0.02)
+    print "Ready!"
+    return d[0] + d[1]*256, d[2] + d[3]*256
+
 def Close():
-    # global h
-    if h:
-        h.close()
+    if info.h:
+        info.io.close()
+        info.h.close()
+        info.h = None
 
 def Load( name):
     # init and empty code dictionary 
@@ -309,48 +1239,321 @@ def EmptyRow( waddr):
         if info.dHex[ iaddr+x] != 0xff: return False
     return True
 
-def Execute():
-    # 1. fix the App reset vector 
+def EraseBlocks( blocks):
+    # erase a list of blocks, contiguous runs in one command when possible
+    eblk = info.EraseBlock
+    print "Erasing ..."
+    x = 0
+    while x < len( blocks):
+        n = 1
+        if info.Caps & capERASEN:
+            while x+n < len( blocks) and blocks[x+n] == blocks[x]+n and n < EraseChunk:
+                n += 1
+        #print "Erase( %d, %d)" % ( blocks[x] * eblk, n)
+        Erase( blocks[x] * eblk, n)
+        x += n
+
+def FixVectors():
+    # 1. fix the App reset vector (once per image)
     d = info.dHex                               
+    v = extend32bit( [], info.BootStart) 
+    jump = [ 0x80+(v[1]), 0x31, v[0], 0x28+( v[1] & 0x7)]
+    if [ d[x] for x in xrange(4)] == jump:
+        return                              # done already
     a = (info.BootStart*2)-4                # copy it to appReset = BootStart -4
     for x in xrange(4):                     # copy 
         d[a+x] = d[x]
 
     # 2. fix the reset vector to point to BootStart
-    v = extend32bit( [], info.BootStart) 
     #     high              movlp           low                  goto
-    d[0]=0x80+(v[1]);   d[1]=0x31;      d[2]=v[0];      d[3]=0x28+( v[1] & 0x7) 
+    d[0]=jump[0];       d[1]=jump[1];   d[2]=jump[2];   d[3]=jump[3]
     # print "Reset Vector ->", v[1], v[0]
     # d[0] = 0x8E;            d[1]=0x31;      d[2]=0x00;      d[3]=0x2E
     print d[0], d[1], d[2], d[3]
 
-    # 3. erase blocks 1..last
+def Execute( delta=False, resume=False):
+    # 1.-2. fix the reset vectors
+    FixVectors()
+    done = 0                                    # rows written already
+    if info.Caps & capCHECK:
+        image = HexCrc( 0, info.BootStart)
+        if resume:
+            prev, done = Checkpoint( image, False)
+            if prev == image:
+                print "Resuming after %d rows" % done
+                delta = False                   # same row sequence as before
+            elif prev == image ^ 0xffff:
+                print "Resuming a delta update"
+                delta = True                    # rows written already match
+                done = 0
+            else:
+                done = 0
+
+    # 3. erase blocks 1..last (delta: only the changed ones),
+    #    the blank ones only when each write erases its own row
     eblk = info.EraseBlock                      # compute erase block size in word
+    wwblk = info.WriteBlock                     # compute the write block size 
+    flags = 0
     last = info.BootStart / eblk                # compute number of erase blocks excluding Bootloader    
-    print "Erasing ..."
-    for x in xrange( 1, last):
-        #print "Erase( %d, %d)" % ( x * eblk, 1)
-        Erase( x * eblk)                        # erase one at a time
+    blocks = range( 1, last)
+    block0 = True
+    delta = delta and info.Caps & capHASH
+    if delta:
+        blocks = ChangedBlocks()
+        block0 = 0 in blocks                    # reset vector row unchanged?
+        blocks = [ b for b in blocks if b != 0]
+    if info.Caps & capVALID and ( blocks or block0):
+        Validate( False)                        # until verified
+    if info.Caps & capCHECK and not done:
+        Checkpoint( image ^ 0xffff if delta else image, True)  # count from here
+    if info.Caps & capERASEW and eblk == wwblk and ( delta or not info.Caps & capERASEN):
+        # erase and write in one command, only for the rows with data: a blank
+        # row would cost a whole frame padded for the erase stall, so blank
+        # blocks are erased apart, a range at a time with capERASEN (fewer
+        # bytes sent, one erase stall more per run of blank blocks)
+        flags = WR_ERASE
+        blank = [ b for b in blocks if EmptyRow( b * eblk)]
+        if blank and not done:
+            EraseBlocks( blank)
+    elif not done:
+        EraseBlocks( blocks)                    # a range at a time
 
     # 4. program blocks 1..last (if not FF)
-    wwblk = info.WriteBlock                     # compute the write block size 
-    last = info.BootStart / wwblk               # compute number of write blocks excluding Bootloader
-    print "writeBlock= %d, last block = %d" % ( wwblk, last)
-    for x in xrange( eblk/wwblk, last):         # write all  rows starting from second erase block
-        if not EmptyRow( x * wwblk):            # skip empty rows
-            # print "WriteRow( %X)" % (x * wwblk)
-            WriteRow( x*wwblk)                  # write to device
-            pass
-
-    # 5. erase block 0
-    Erase( 0)
-    # print "Erase( 0)"
+    print "writeBlock= %d, last block = %d" % ( wwblk, info.BootStart / wwblk)
+    rows = [ x*wwblk for b in blocks for x in xrange( b*eblk/wwblk, (b+1)*eblk/wwblk)
+             if not EmptyRow( x * wwblk)]       # skip empty rows, erased above
+    if not block0 and not rows:
+        print "Nothing to do"
+        return
+    skip = min( done, len( rows))               # resumed: written already
+    rows = rows[ skip:]
+    done -= skip
+    if info.Caps & capWRITEW and Window > 1:
+        if rows: WriteWindow( rows, flags)      # pipelined
+    else:
+        for x, waddr in enumerate( rows):
+            # print "WriteRow( %X)" % waddr
+            WriteRow( waddr, flags)             # write to device
+            Progress( x, x+1, len( rows))
+
+    # 5. erase block 0 (as part of its write when possible)
+    if not block0:
+        return
+    if info.Caps & capERASEW and eblk == wwblk:
+        flags = WR_ERASE
+    elif not done:
+        flags = 0
+        Erase( 0)
+        # print "Erase( 0)"
 
     # 6. program all rows of block 0 
-    for x in xrange( eblk/wwblk):          
-       WriteRow( x * wwblk)
+    for x in xrange( done, eblk/wwblk):          
+       WriteRow( x * wwblk, flags)
         # print "WriteRow( %X)" % (x * wwblk)
 
+def Program( port, baud=BaudDefault, delta=False, resume=False, tries=-1):
+    # connect, program and verify the image loaded, then restart the device,
+    # return True on success, tries bounds connecting and sync (-1 = no limit)
+    ConnectLoop( port, tries)
+    if not Sync( tries):  # check the sync
+        raise ConnectionFailed( 'no device on %s' % port)
+    Identify()      # get the device infos
+    Boot()          # lock into boot mode
+    if baud != BaudDefault and info.Caps & capBAUD:
+        SetBaud( baud)
+    bad = Update( delta, resume)
+    if info.Caps & capSTATS:
+        Stats()     # report the device receive errors
+    ReBoot()
+    return not bad
+
+def Overlap():
+    # word addresses of image data in the bootloader, which the device
+    # acknowledges but never writes: such an image is refused
+    over = sorted( set( a / 2 for a in info.dHex.addresses()
+                        if info.BootStart*2 <= a < info.McuSize))
+    if over:
+        print "Image data at 0x%04x-0x%04x, in the bootloader (0x%04x up), not programmed" % (
+              over[0], over[-1], info.BootStart)
+    return over
+
+def Update( delta=False, resume=False):
+    # program the image loaded, verify it, write its data EEPROM and mark
+    # the application valid, return what failed (empty on success)
+    over = Overlap()
+    if over:
+        return over
+    Execute( delta, resume)
+    bad = []
+    if info.Caps & capCRC:
+        bad = Verify()  # compare CRCs of the application range
+    if not bad:
+        bad = EEProgram()   # with the application it goes with
+    if info.Caps & capVALID and not bad:
+        Validate( True) # runs at the next reset
+    return bad
+
+#----------------------------------------------------------------------
+# Fleet programming
+#   one thread per port, each with its own session (info) and engine,
+#   the output lines are tagged with the port they belong to
+
+class FleetOutput( threading.local):
+    # per thread partial line (and print softspace), whole lines go out
+    lock = threading.Lock()
+
+    def __init__( self, out):
+        self.out = out
+        self.line = ''
+
+    def write( self, s):
+        lines = ( self.line + s).split( '\n')
+        self.line = lines[-1]
+        with self.lock:
+            for line in lines[:-1]:
+                self.out.write( '%s: %s\n' % ( threading.current_thread().name, line))
+            self.out.flush()
+
+    def flush( self):
+        pass
+
+def FleetJob( job, baud, delta, resume):
+    # program one device, job = [ port, hex file, result, time (s), bytes sent]
+    start = time.time()
+    try:
+        if not Load( job[1]):
+            print "File %s not found" % job[1]
+        else:
+            job[2] = Program( job[0], baud, delta, resume, FleetTries)
+    except Exception as e:
+        print "Failed: %s" % e
+        Close()
+    job[3] = time.time() - start
+    if info.io:
+        job[4] = info.io.sent
+
+def Fleet( ports, baud=BaudDefault, delta=False, resume=False):
+    # program every (port, hex file) concurrently, then print a summary,
+    # return True if all succeeded
+    jobs = [ [ port, name, False, 0, 0] for port, name in ports]
+    threads = [ threading.Thread( target=FleetJob, name=job[0], args=( job, baud, delta, resume))
+                for job in jobs]
+    for t in threads: t.daemon = True
+    start = time.time()
+    stdout = sys.stdout
+    sys.stdout = FleetOutput( stdout)
+    try:
+        for t in threads: t.start()
+        for t in threads:
+            while t.is_alive():
+                t.join( 1)          # stay responsive to Ctrl-C
+    finally:
+        sys.stdout = stdout
+    elapsed = time.time() - start
+    print "%-16s %-20s %6s %8s %8s" % ( 'Port', 'File', 'Result', 'Time(s)', 'Bytes')
+    for port, name, ok, t, sent in jobs:
+        print "%-16s %-20s %6s %8.2f %8d" % ( port, name, 'OK' if ok else 'FAILED', t, sent)
+    total = sum( job[4] for job in jobs)
+    print "%d of %d devices programmed in %.2f s, %d bytes, aggregate %.0f bytes/s" % (
+          len( [ job for job in jobs if job[2]]), len( jobs), elapsed, total, total / elapsed)
+    return all( job[2] for job in jobs)
+
+#----------------------------------------------------------------------
+# Bus programming
+#   all the nodes of a 9-bit addressed (RS-485) bus get the same rows at
+#   once (broadcast), then each one is checked (CRC) and repaired alone
+
+def Broadcast( rows):
+    # stream erase and write frames to all the nodes, no acknowledge,
+    # the idle padding of each frame covers the stalls
+    print "Broadcasting %d rows ..." % len( rows)
+    Select( BROADCAST)
+    for x, waddr in enumerate( rows):
+        info.io.send( WriteFrame( x, waddr, WR_ERASE))
+        Progress( x, x+1, len( rows))
+
+def Repair( bad):
+    # rewrite the rows of the (start, end) word ranges Verify() reported,
+    # row 0 (reset vector) last
+    wwblk = info.WriteBlock
+    rows = sorted( set( row - row % wwblk for start, end in bad
+                        for row in xrange( start, end, wwblk)), reverse=True)
+    print "Repairing %d rows ..." % len( rows)
+    for waddr in rows:
+        WriteRow( waddr, WR_ERASE)
+
+def Bus( port, nodes, delta=False):
+    # program the image loaded into every node listed, return True on success
+    bad = [ node for node in nodes if not NodeValid( node) or node == 0xff]
+    if bad:
+        print "Invalid node address %s, 1..254 only" % ', '.join( map( str, bad))
+        return False
+    start = time.time()
+    ConnectLoop( port)
+    info.h.parity = serial.PARITY_SPACE     # 9-bit frames, data
+    live = []
+    for node in nodes:
+        print "Node %d:" % node,
+        Select( node)
+        if Sync( 4):
+            Boot()                          # lock into boot mode
+            live.append( node)
+    if not live:
+        Close()
+        return False
+    Select( live[0])
+    Info()                                  # all the nodes alike
+    eblk = info.EraseBlock
+    wwblk = info.WriteBlock
+    if not info.Caps & capBUS or not info.Caps & capERASEW or eblk != wwblk:
+        print "Bus programming not supported by this bootloader"
+        Close()
+        return False
+    if Overlap():
+        Close()
+        return False
+    FixVectors()
+    if info.Caps & capVALID:
+        for node in live:                   # not in the broadcast stream
+            Select( node)
+            Validate( False)
+
+    # all the rows (delta: of the blocks changed in any node), block 0 last
+    last = info.BootStart / eblk
+    blocks = range( 1, last) + [ 0]
+    if delta and info.Caps & capHASH:
+        changed = set()
+        for node in live:
+            Select( node)
+            changed.update( ChangedBlocks())
+        blocks = [ b for b in blocks if b in changed]
+    Broadcast( [ b*eblk for b in blocks])
+
+    # check each node, rewrite what it missed
+    result = {}
+    for node in live:
+        print "Node %d:" % node,
+        Select( node)
+        if not Sync( 4):
+            continue
+        bad = Verify()
+        if bad:
+            Repair( bad)
+            bad = Verify()
+        if info.Caps & capVALID and not bad:
+            Validate( True)
+        result[ node] = not bad
+    Select( BROADCAST)
+    ReBoot()                                # all at once
+
+    elapsed = time.time() - start
+    for node in nodes:
+        print "Node %3d: %s" % ( node, 'OK' if result.get( node) else 'FAILED')
+    print "%d of %d nodes programmed in %.2f s, %d rows, %.0f rows/s aggregate" % (
+          len( [ n for n in result if result[ n]]), len( nodes), elapsed, len( blocks),
+          len( blocks) * len( result) / elapsed)
+    return all( result.get( node) for node in nodes)
+
 ###################################################################
 # main window definition
 #
@@ -445,17 +1648,21 @@ class MainWindow():
             self.fileHex.set( '')
 
     def cmdProgram( self):
-        # Execute()
-        # try:
-            # WriteTest()
-            Execute()
-        # except:
-            # programming error 
-            # self.Status.set( "Programming failed")
-        # else:
-            self.Status.set( "Programming successful")
+        # same sequence as Program(), on the connection cmdInit() opened
+        if not info.h:
+            self.Status.set( "Not connected")
+            return
+        try:
+            Identify()      # get the device infos
+            bad = Update()  # the application is marked valid last
             ReBoot()
-            #root.destroy()
+        except ProtocolError:
+            self.Status.set( "Programming failed")
+            return
+        if bad:
+            self.Status.set( "Verify failed")
+        else:
+            self.Status.set( "Programming successful")
 
 #----------------------------------------------------------------------------
 
@@ -469,25 +1676,95 @@ if __name__ == '__main__':
             exit(0)
 
     # command line mode
-    # if a file name is passed
-    if len(sys.argv) == 1:
-        print "Usage: %s (-gui) file.hex"
-        exit(1)
-    else:
-        name = sys.argv[1]
-
-    # load the hex file provided
-    if not Load(name):
-        print "File %s not found" % name
+    # options: -p serial port, -w max rows in flight (1 = no windowing)
+    #          -b baud rate for programming
+    #          -r read the device flash into file.hex instead
+    #          -d delta, write only the rows that changed
+    #          -c continue an interrupted update (see Resume)
+    #          -i always send INFO, no profile cache (see Identification)
+    # several -p options program all the ports at once (fleet), each one
+    # with file.hex or its own image given as -p port=image.hex
+    #          -a nodes, program the nodes (1,2,5-8) of a 9-bit bus at once
+    #          -n node[:group], set the bus addresses of the device
+    #          -t trace.jsonl, record the wire traffic (see Trace, replay.py)
+    #          -e text, application command requesting boot mode (C escapes)
+    try:
+        opts, args = getopt.getopt( sys.argv[1:], 'p:w:b:rdcia:n:t:e:')
+    except getopt.GetoptError:
+        args = [ None, None]
+    ports = [ tuple( a.split( '=', 1)) if '=' in a else ( a, None)
+              for o, a in opts if o == '-p']
+    name = args[0] if args else None
+    setnode = [ a for o, a in opts if o == '-n']
+    if len(args) > 1 or not ( name or ports and all( p[1] for p in ports) or setnode):
+        print "Usage: %s (-gui) [-p port[=image.hex]]... [-w window] [-b baud] [-r] [-d] [-c] [-i]" % sys.argv[0],
+        print "[-a nodes] [-n node[:group]] [-t trace.jsonl] [-e text] file.hex"
         exit(1)
+    port = ports[0][0] if ports else None
+    baud = BaudDefault
+    read = False
+    delta = False
+    resume = False
+    nodes = []
+    for o, a in opts:
+        if o == '-w': Window = int(a)
+        if o == '-b': baud = int(a)
+        if o == '-r': read = True
+        if o == '-d': delta = True
+        if o == '-c': resume = True
+        if o == '-i': Profiles = None
+        if o == '-t': trace = Trace( a)
+        if o == '-e': WakeUp = a.decode( 'string_escape')
+        if o == '-a':
+            for r in a.split( ','):
+                r = [ int( x, 0) for x in r.split( '-')]
+                nodes += range( r[0], r[-1]+1)
+
+    if setnode:
+        node = [ int( x, 0) for x in setnode[0].split( ':')] + [ 0xff]
+        ConnectLoop( port)
+        Sync()
+        Info()
+        Boot()
+        ok = False
+        if info.Caps & capBUS:
+            ok = SetNode( node[0], node[1])
+        else:
+            print "Bus not supported by this bootloader"
+        ReBoot()
+        exit( 0 if ok else 1)
+
+    if nodes:
+        if not Load( name or ports[0][1]):
+            print "File %s not found" % name
+            exit(1)
+        exit( 0 if Bus( port, nodes, delta) else 1)
+
+    if len( ports) > 1 and not read:
+        ok = Fleet( [ ( p, image or name) for p, image in ports], baud, delta, resume)
+        exit( 0 if ok else 1)
+    if ports and ports[0][1]:
+        name = ports[0][1]
+
+    # load the hex file provided, run the erase/program sequence
+    if not read:
+        if not Load(name):
+            print "File %s not found" % name
+            exit(1)
+        exit( 0 if Program( port, baud, delta, resume) else 1)
 
     # loops until gets a connection
-    ConnectLoop()
-
-    # run the erase/program sequence
-    Execute()
-
-    # 
+    ConnectLoop( port)
+    Sync()          # check the sync
+    Identify()      # get the device infos
+    Boot()          # lock into boot mode
+    if baud != BaudDefault and info.Caps & capBAUD:
+        SetBaud( baud)
+
+    if info.Caps & capREAD:
+        Dump( name)
+    else:
+        print "Read not supported by this bootloader"
     ReBoot()
 
 
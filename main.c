@@ -1,5 +1,5 @@
 /*
- * Serial High BootLoader for PIC16F1783 Buck Click
+ * Serial High BootLoader for PIC16F1783 Buck Click (other parts: Device.h)
  *
  * File:   main.c
  * Author: Lucio Di Jasio
@@ -13,15 +13,23 @@
 
 #include <string.h>
 
-// program memory organization for PIC16F1783
-#define BOOT_START    0x0E00       // row aligned high start of bootloader
-#define APP_START     BOOT_START-2 // ljmp to application 
+// program memory organization: BOOT_START, APP_START, see Device.h
 
+// clock dependent settings, reset (application) clock and boot mode clock
+#define BRG_RESET     EUSART_BRG( _XTAL_FREQ, EUSART_BAUD_DEFAULT)
+#define BRG_BOOT      EUSART_BRG( _XTAL_FREQ_BOOT, EUSART_BAUD_DEFAULT)
+#define TMR0_PS_RESET 2            // 1:8  at  8MHz, ~1ms overflow
+#define TMR0_PS_BOOT  4            // 1:32 at 32MHz, ~1ms overflow
+#define T1CON_BOOT    0x31         // TMR1 Fosc/4, 1:8, on: 1us at 32MHz
+
+#ifdef SIM
+#include "sim/sim.h"                // host build, see sim/sim.c
+#else
 inline void bootLoad( void) @BOOT_START
 { // ensure a jump to bootloader init is placed at BOOT_START
 #asm
         PAGESEL     (start_initialization)
-        goto        (start_initialization)&0x7ff
+        goto        (start_initialization)&FLASH_PAGEMASK
 #endasm
 }
 
@@ -29,10 +37,11 @@ inline void runApp( void)
 { // run the application
 #asm
                 PAGESEL     APP_START
-                goto        APP_START&0x7FF
+                goto        APP_START&FLASH_PAGEMASK
 #endasm
 
 }
+#endif
 /**************************************************************************
 Protocol Description.
 
@@ -70,8 +79,198 @@ Protocol Description.
     | Restart MCU              |                  <STX><cmdREBOOT>                 |
     | Write to MCU flash       | <STX><cmdWRITE><START_ADDR><DATA_LEN><DATA_ARRAY> |
     | Erase MCU flash.         |  <STX><cmdERASE><START_ADDR><ERASE_BLOCK_COUNT>   |
+    | Windowed write to flash  | <STX><cmdWRITEW><SEQ><START_ADDR><DATA_LEN>       |
+    |                          |                       <DATA_ARRAY><CHECKSUM>      |
+    | Send statistics          |                  <STX><cmdSTATS>                  |
+    | Change baud rate         |                <STX><cmdBAUD><BRG>                |
+    | CRC of a flash range     |           <STX><cmdCRC><START_ADDR><COUNT>        |
+    | Read flash               |           <STX><cmdREAD><START_ADDR><COUNT>       |
+    | Row digest table         |           <STX><cmdHASH><START_ADDR><COUNT>       |
+    | Set bus node address     |        <STX><cmdNODE><NODE><GROUP><CHECK>         |
+    | Mark application valid   |               <STX><cmdVALID><VALID>              |
+    | Update checkpoint        |            <STX><cmdCHECK><ID><START>             |
+    | Write data EEPROM        |  <STX><cmdEEWRITE><START_ADDR><COUNT><DATA_ARRAY> |
+    | Read data EEPROM         |          <STX><cmdEEREAD><START_ADDR><COUNT>      |
+    | Identify the device      |                  <STX><cmdIDENT>                  |
      ------------------------------------------------------------------------------
 
+    * Windowed write.
+
+    The host can keep several cmdWRITEW frames in flight without waiting for
+    each acknowledge. SEQ is a modulo 256 row sequence number (reset to 0 by
+    cmdSYNC), CHECKSUM makes the byte sum of SEQ..CHECKSUM equal to zero.
+    A frame is written only if its checksum is good and SEQ is the next one
+    expected, otherwise it is dropped. Every frame is acknowledged with the
+    SEQ of the last row written in order (cumulative acknowledge), so the
+    host resends everything after it (go back N). The host pads each frame
+    with idle (non STX) bytes covering the self-write stall, as the receiver
+    overruns while the CPU is halted.
+
+    * Packed data.
+
+    Setting WR_PACKED (0x4000) in DATA_LEN sends DATA_ARRAY as a little
+    endian bit stream of 14-bit words, word n in bits 14n..14n+13, padded to
+    a whole byte: 4 words take 7 bytes instead of 8.
+
+    * Run length encoded data.
+
+    Setting WR_RLE (0x2000) in DATA_LEN sends DATA_ARRAY as a sequence of
+    tokens, each one byte followed by words (lsb first), until DATA_LEN words
+    are expanded:
+        0x80 | (n-1), WORD              - repeat run, n copies of WORD
+        0x00 | (n-1), WORD[0..n-1]      - literal run, n words
+    The host uses it for a row only when it is shorter than the plain (or
+    packed) data.
+
+    * Erase.
+
+    cmdERASE erases ERASE_BLOCK_COUNT consecutive rows from the one containing
+    START_ADDR, stopping short of the bootloader, then acknowledges once.
+
+    * Erase and write.
+
+    Setting WR_ERASE (0x8000) in the DATA_LEN field of cmdWRITE or cmdWRITEW
+    erases the row containing START_ADDR before programming DATA_ARRAY, with
+    a single acknowledge. DATA_LEN may be 0 (erase only). The host uses it
+    when INFO reports capERASEW and erase blocks and write rows match.
+
+    A row at or above BOOT_START, or DATA_LEN running past the end of the
+    row of START_ADDR, is acknowledged but neither erased nor written; the
+    following Verify reports it.
+
+    * CRC.
+
+    cmdCRC returns the CRC-16 (CCITT polynomial 0x1021, seed 0xFFFF) of COUNT
+    words of program memory from START_ADDR, each 14-bit word fed lsb first,
+    so the host can verify a range without reading it back.
+    cmdHASH streams the same CRC for each of COUNT rows from the one containing
+    START_ADDR, the digest table the host compares to a new image to erase
+    and write only the rows that changed (delta flashing).
+
+    * Read.
+
+    cmdREAD streams COUNT words (lsb first) of program memory from START_ADDR
+    right after the acknowledge, with no further handshake, any range up to
+    the whole flash.
+
+    * Data EEPROM.
+
+    cmdEEWRITE writes COUNT (up to EE_BURST) bytes of data EEPROM from
+    START_ADDR (0..255, the hex file keeps them at word 0xF000 up). Each
+    byte write (~4ms) runs in the background while the next bytes are
+    received, the burst waits in the receive buffer, so the command takes
+    about COUNT byte writes, acknowledged once all are done. Bytes already
+    holding the value are not written, nor the bootloader locations from
+    EE_RESERVED up. A COUNT above EE_BURST is received but nothing written.
+
+    cmdEEREAD streams COUNT bytes from START_ADDR right after the
+    acknowledge, wrapping from address 255 to 0. A COUNT above
+    EEPROM_SIZE (the whole data EEPROM) is cut to EEPROM_SIZE.
+
+    * Identification.
+
+    INFO field 2 (MCUID) holds the device ID word read from configuration
+    space (DEVICE_ID, 0x8006: device in bits 13..5, revision in bits 4..0).
+    cmdIDENT sends it with the bootloader revision, CAPS, BOOT_START and the
+    row size (words, 16-bit each), so a host that has met the same device
+    and layout before uses the INFO it decoded then. BOOT_SIZE is a build
+    option, the same device ID does not imply the same layout.
+
+    * Baud rate change.
+
+    BRG is the 16-bit baud rate generator divisor, baud = Fosc/(4*(BRG+1)),
+    computed by the host from the INFO oscillator frequency. The device
+    acknowledges at the current rate, switches, then waits BAUD_TIMEOUT ms
+    for a <STX><cmdSYNC> at the new rate (acknowledged at the new rate).
+    If none arrives it falls back to 19200 baud, where the host syncs again.
+
+    Rates within 2.5% at Fosc = 32MHz (boot mode clock):
+     --------+-------+----------+--------
+    |  baud  |  BRG  |  actual  | error  |
+    |  19200 |  416  |   19185  | -0.08% |
+    |  38400 |  207  |   38462  | +0.16% |
+    |  57600 |  138  |   57554  | -0.08% |
+    | 115200 |   68  |  115942  | +0.64% |
+    | 125000 |   63  |  125000  |  0.00% |
+    | 230400 |   34  |  228571  | -0.79% |
+    | 250000 |   31  |  250000  |  0.00% |
+    | 460800 |   16  |  470588  | +2.12% |
+    | 500000 |   15  |  500000  |  0.00% |
+    |1000000 |    7  | 1000000  |  0.00% |
+    |2000000 |    3  | 2000000  |  0.00% |
+     --------+-------+----------+--------
+
+    * Multi-drop bus (RS-485).
+
+    A device whose data EEPROM holds a node address (EE_NODE, 1..0xFE) runs
+    the EUSART in 9-bit mode with address detect. The host sends a byte with
+    the 9th bit set (mark parity) to select the node that receives the
+    following commands:
+        NODE            - the node answers as usual
+        GROUP           - all the nodes of a group (EE_GROUP) execute them
+        0x00            - all the nodes execute them (broadcast)
+    Nodes never answer a group or broadcast command. cmdWRITEW frames are
+    then written whatever their SEQ, if the checksum is good, so the host
+    streams the same rows to all nodes, then selects each node in turn to
+    check the CRCs and rewrite the rows it missed.
+    cmdNODE stores NODE and GROUP (1..0xFE, 0xFF = none) in the data EEPROM,
+    they take effect at the next reset, NODE = 0xFF leaves the bus. CHECK
+    makes the sum of NODE, GROUP and CHECK zero; a pair failing it, or
+    holding the broadcast address 0x00, is not stored. The answer reads
+    both back from the EEPROM, the host compares them with the ones sent.
+
+    * Application valid marker.
+
+    A byte of data EEPROM (EE_APP) tells whether the application is whole.
+    The device clears it at the first erase or write of a session, the host
+    clears it with cmdVALID (VALID = 0) before changing the flash, so the
+    windowed stream is not held up by the EEPROM write, and sets it
+    (VALID = 1) once the image verified. At reset a marked application
+    runs at once when CS reads high, without waiting for the pull-up to
+    settle, a low CS is confirmed after ~1ms. Without the marker (update
+    interrupted, bootloader just installed) the device stays in boot mode.
+
+    * Application request.
+
+    The application asks for an update by writing BOOT_REQUEST to EE_BOOT
+    (data EEPROM) and resetting itself, e.g. when told so over the serial
+    port (see SerialBoot16.py -e):
+        EEPROM_write( 0xFC, 0xB0); RESET();
+    The device then stays in boot mode whatever CS and the marker say,
+    until a session ends with cmdREBOOT, which clears the request.
+
+    * Checkpoint.
+
+    The device counts the rows written (cmdWRITE and cmdWRITEW frames
+    executed, erase only included) for the image being programmed, so a
+    host can resume an interrupted update. cmdCHECK with START = 1 begins
+    a new count for image ID (16-bit, chosen by the host), START = 0 only
+    queries it; both answer with the ID and ROWS before the command.
+    The count is kept in RAM, exact after a cable drop, and saved in data
+    EEPROM once the line stays idle CHECK_IDLE ms, never in the middle of
+    a windowed stream, so after a power loss it may be short (rows are then
+    written again, with the same data).
+
+    * Statistics.
+
+    cmdSTATS sends <COUNT> followed by COUNT words:
+        0  receive overruns (bytes lost)    5  last row erase (us)
+        1  receive framing errors           6  longest row erase (us)
+        2  bytes received                   7  row writes
+        3  receiver OERR events             8  last row write (us)
+        4  row erases                       9  longest row write (us)
+    then for each command: <CMD_CODE><number received><longest (us)>.
+    Durations are TMR1 counts (1us in boot mode), a command is timed from
+    its code to the end of its execution (parameters, data and answer
+    included) and saturates at 65535us. Counters wrap, all start at reset.
+
+    * Clock.
+
+    The device resets at 8MHz (_XTAL_FREQ), as the application expects.
+    Once it stays in boot mode it switches to the 4x PLL (_XTAL_FREQ_BOOT),
+    rescaling the baud rate generator and the TMR0 prescaler, and switches
+    back before running the application. INFO reports the boot mode clock.
+
      * Acknowledge format.
 
     <STX[0]><CMD_CODE[0]>
@@ -95,6 +294,18 @@ Protocol Description.
     | Restart MCU              |                  no acknowledge                   |
     | Write to MCU flash       | upon each write of internal buffer data to flash  |
     | Erase MCU flash.         |                  upon execution                   |
+    | Windowed write to flash  |     <STX><cmdWRITEW><SEQ> upon each frame         |
+    | Send statistics          | upon reception, then <COUNT><WORD[0..COUNT-1]>    |
+    | Change baud rate         |    upon reception (old rate), then SYNC (new)     |
+    | CRC of a flash range     |            upon reception, then <CRC>             |
+    | Read flash               |      upon reception, then <DATA[0..COUNT-1]>      |
+    | Row digest table         |      upon reception, then <CRC[0..COUNT-1]>       |
+    | Set bus node address     |       upon execution, then <NODE><GROUP>          |
+    | Mark application valid   |                  upon execution                   |
+    | Update checkpoint        |       upon execution, then <ID><ROWS>             |
+    | Write data EEPROM        |                  upon execution                   |
+    | Read data EEPROM         |      upon reception, then <DATA[0..COUNT-1]>      |
+    | Identify the device      |  upon reception, then <ID><REV><CAPS><BOOT><ROW>  |
 
 *******************************************************************************/
 
@@ -105,12 +316,92 @@ Protocol Description.
 #define cmdREBOOT       'R'//4
 #define cmdWRITE        'W'//11
 #define cmdERASE        'E'//21
+#define cmdWRITEW       'P'//12
+#define cmdSTATS        'T'//13
+#define cmdBAUD         'U'//14
+#define cmdCRC          'C'//15
+#define cmdREAD         'D'//16
+#define cmdHASH         'H'//17
+#define cmdNODE         'A'//18
+#define cmdVALID        'V'//19
+#define cmdCHECK        'K'//20
+#define cmdEEWRITE      'M'//21
+#define cmdEEREAD       'N'//22
+#define cmdIDENT        'G'//23
+
+// Bootloader capabilities (INFO field 9)
+#define capWRITEW       0x0001      // windowed write supported
+#define capSTATS        0x0002      // statistics supported
+#define capBAUD         0x0004      // baud rate change supported
+#define capERASEW       0x0008      // erase and write (WR_ERASE) supported
+#define capERASEN       0x0010      // erase ERASE_BLOCK_COUNT rows supported
+#define capCRC          0x0020      // range CRC supported
+#define capREAD         0x0040      // flash read supported
+#define capHASH         0x0080      // row digest table supported
+#define capPACK         0x0100      // packed write data (WR_PACKED) supported
+#define capRLE          0x0200      // run length encoded data (WR_RLE) supported
+#define capBUS          0x0400      // 9-bit addressed bus (cmdNODE) supported
+#define capVALID        0x0800      // application valid marker (cmdVALID)
+#define capCHECK        0x1000      // resume checkpoint (cmdCHECK)
+#define capEEPROM       0x2000      // data EEPROM write/read (cmdEEWRITE/READ)
+#define capIDENT        0x4000      // device identification (cmdIDENT)
+#define CAPS            ( capWRITEW | capSTATS | capBAUD | capERASEW \
+                        | capERASEN | capCRC | capREAD | capHASH | capPACK \
+                        | capRLE | capBUS | capVALID | capCHECK | capEEPROM \
+                        | capIDENT)
+
+#define BOOT_REVISION   0x0100      // bootloader revision 0.1
+#define DEVICE_ID       0x06        // device ID word (0x8006), configuration space
+
+// DATA_LEN flags
+#define WR_ERASE        0x8000      // erase the row before writing
+#define WR_PACKED       0x4000      // 14-bit words packed, 4 words in 7 bytes
+#define WR_RLE          0x2000      // run length encoded words
+#define WR_FLAGS        0xE000      // mask, the rest is the word count
+
+#define BAUD_TIMEOUT    1000        // ms to sync at a new baud rate
+#define CHECK_IDLE      100         // ms of idle line before saving the checkpoint
+#define EE_BURST        64          // max cmdEEWRITE bytes, fit the receive buffer
+
+// data EEPROM locations used by the bootloader
+#define EE_NODE         0xFF        // bus node address, 0xFF = not on a bus
+#define EE_GROUP        0xFE        // bus group address, 0xFF = none
+#define EE_APP          0xFD        // APP_VALID = application whole
+#define APP_VALID       0x5A
+#define EE_BOOT         0xFC        // BOOT_REQUEST = application asks for boot mode
+#define BOOT_REQUEST    0xB0
+#define EE_CHECK_ID     0xF8        // checkpoint image ID (2 bytes)
+#define EE_CHECK_ROWS   0xFA        // checkpoint rows written (2 bytes)
+#define EE_RESERVED     EE_CHECK_ID // bootloader locations from here up
 
 // Supported MCU families/types.
 //enum { PC16 = 1, PIC18 = 2, PIC18FJ = 3, PIC24 = 4,  dsPIC = 10, PIC32' = 20;)  dMcuType ;
 #define mcuPIC16    1
 
 uint16_t data[FLASH_ROWSIZE];       // data buffer
+uint8_t  seq;                       // next windowed write sequence number
+uint8_t  chk;                       // running sum of the received bytes
+bool     appValid;                  // EE_APP holds APP_VALID
+uint16_t checkId;                   // checkpoint, image being written
+uint16_t checkRows;                 // rows written for it
+bool     checkDirty;                // checkRows not saved yet
+
+// statistics, see stats()
+typedef struct {
+    uint16_t count;                 // number of operations
+    uint16_t last;                  // duration of the last one (us)
+    uint16_t max;                   // longest (us)
+} timing_t;
+
+const uint8_t cmdTable[] = { cmdSYNC, cmdINFO, cmdBOOT, cmdREBOOT, cmdWRITE,
+    cmdERASE, cmdWRITEW, cmdSTATS, cmdBAUD, cmdCRC, cmdREAD, cmdHASH, cmdNODE,
+    cmdVALID, cmdCHECK, cmdEEWRITE, cmdEEREAD, cmdIDENT};
+#define CMD_COUNT       sizeof( cmdTable)
+
+timing_t eraseTiming;               // row erases (CPU stall)
+timing_t writeTiming;               // row writes (CPU stall)
+uint16_t cmdCount[ CMD_COUNT];      // commands received
+uint16_t cmdMax[ CMD_COUNT];        // longest execution (us)
 
 #define putch   EUSART_Write
 #define getch   EUSART_Read
@@ -125,6 +416,17 @@ void putw( uint16_t w)
     putch( w>>8);       // msb
 }
 
+/**
+ *  Receive a byte and add it to the running checksum
+ *  @return unsigned 8-bit value
+ */
+uint8_t getb( void)
+{
+    uint8_t b = getch();
+    chk += b;
+    return b;
+} // getb
+
 /**
  *  Receive a word (lsb First)
  *  @return unsigned 16-bit value
@@ -136,8 +438,8 @@ uint16_t getw( void)
         uint16_t    word;
     } r;
 
-    r.byte[0] = getch();
-    r.byte[1] = getch();
+    r.byte[0] = getb();
+    r.byte[1] = getb();
     return  r.word;
 } // getw
 
@@ -147,21 +449,88 @@ uint16_t getw( void)
  */
 void info( void)
 {
-    putch( 23+20);                            // 1, info block size
+    putch( 34+20);                            // 1, info block size
     putch( 1);    putw( mcuPIC16);            // 3, mcuType
-    putch( 8);    putw( FLASH_SIZE); putw(0); // 5, total amount of flash available
-//    putch( 2);    putw( 0x1783);              // mcuID unused
+    putch( 8);    putw( (uint16_t)FLASH_SIZE);// 5, total amount of flash available
+                  putw( FLASH_SIZE >> 16);
+    putch( 2);    putw( FLASH_readConfig( DEVICE_ID)); // 3, mcuID and revision
     putch( 3);    putw( FLASH_ROWSIZE );      // 3, erase page size
     putch( 4);    putw( FLASH_ROWSIZE );      // 3, write row size
-    putch( 5);    putw( 0x0100);              // 3, bootloader revision 0.1
+    putch( 5);    putw( BOOT_REVISION);       // 3, bootloader revision
     putch( 6);    putw( BOOT_START); putw(0); // 5, bootloader start address
     putch( 7);                                // 21, 20-byte padded text
     putch( 'B'); putch( 'u'); putch( 'c'); putch( 'k');
     putch( 'C'); putch( 'l');putch( 'i'); putch( 'c'); putch( 'k'); putch( '\0');
     putch( '\0'); putch( '\0'); putch( '\0'); putch( '\0'); putch( '\0');
     putch( '\0'); putch( '\0'); putch( '\0'); putch( '\0'); putch( '\0');
+    putch( 9);    putw( CAPS);                // 3, capabilities
+    putch( 10);   putw( (uint16_t)_XTAL_FREQ_BOOT);// 5, oscillator frequency
+                  putw( _XTAL_FREQ_BOOT >> 16);
 } // info
 
+/**
+ * Send the statistics block, word count followed by the counters
+ */
+void stats( void)
+{
+    uint8_t i;
+
+    putch( 10 + 3 * CMD_COUNT);     // number of words
+    putw( eusartOverrunCount);      // 0, receive overruns (bytes lost)
+    putw( eusartFramingCount);      // 1, receive framing errors
+    putw( eusartByteCount);         // 2, bytes received
+    putw( eusartOerrCount);         // 3, receiver OERR events
+    putw( eraseTiming.count);       // 4..6, row erases
+    putw( eraseTiming.last);
+    putw( eraseTiming.max);
+    putw( writeTiming.count);       // 7..9, row writes
+    putw( writeTiming.last);
+    putw( writeTiming.max);
+    for( i=0; i<CMD_COUNT; i++)
+    {
+        putw( cmdTable[i]);         // command, count, longest
+        putw( cmdCount[i]);
+        putw( cmdMax[i]);
+    }
+} // stats
+
+/**
+ * Update the timing of an operation
+ * @param t         timing record
+ * @param start     TMR1 at the start
+ */
+void timing( timing_t* t, uint16_t start)
+{
+    uint16_t d = TMR1 - start;
+
+    t->count++;
+    t->last = d;
+    if ( d > t->max)
+        t->max = d;
+} // timing
+
+/**
+ * Count a command and update its longest execution, TMR1 was cleared
+ * when its code was received
+ * @param c         command code
+ */
+void timeCommand( uint8_t c)
+{
+    uint16_t d = PIR1bits.TMR1IF ? 0xFFFF : TMR1;   // saturate
+    uint8_t i;
+
+    for( i=0; i<CMD_COUNT; i++)
+    {
+        if ( cmdTable[i] == c)
+        {
+            cmdCount[i]++;
+            if ( d > cmdMax[i])
+                cmdMax[i] = d;
+            return;
+        }
+    }
+} // timeCommand
+
 /**
  * Send an acknowledge
  * @param r     command to be acknowledged
@@ -172,66 +541,485 @@ void ack( uint8_t r)
     putch( r);
 } // ack
 
+/**
+ * Update a CRC-16 (CCITT) with one byte
+ * @param c         current CRC
+ * @param b         data byte
+ * @return          updated CRC
+ */
+uint16_t crc16( uint16_t c, uint8_t b)
+{
+    uint8_t x = ( c >> 8) ^ b;
+    x ^= x >> 4;
+    return ( c << 8) ^ (( uint16_t)x << 12) ^ (( uint16_t)x << 5) ^ x;
+} // crc16
+
+/**
+ * CRC-16 of a range of program memory
+ * @param add       address (16-bit unsigned)
+ * @param count     number of words
+ * @return          CRC, 14-bit words fed lsb first
+ */
+uint16_t crc( uint16_t add, uint16_t count)
+{
+    uint16_t c = 0xFFFF;
+    uint16_t w;
+
+    while( count-- > 0)
+    {
+        w = FLASH_read( add++);
+        c = crc16( c, w);           // lsb
+        c = crc16( c, w >> 8);      // msb
+        EUSART_Receive_Task();      // next commands may be queued
+    }
+    return c;
+} // crc
+
+/**
+ * Send the CRC-16 of each row in a range
+ * @param add       address (16-bit unsigned) in the first row
+ * @param count     number of rows
+ */
+void hash( uint16_t add, uint16_t count)
+{
+    add &= ~FLASH_ROWMASK;
+    while( count-- > 0)
+    {
+        putw( crc( add, FLASH_ROWSIZE));
+        add += FLASH_ROWSIZE;
+    }
+} // hash
+
+/**
+ * Send a range of program memory
+ * @param add       address (16-bit unsigned)
+ * @param count     number of words
+ */
+void dump( uint16_t add, uint16_t count)
+{
+    while( count-- > 0)
+    {
+        putw( FLASH_read( add++));
+    }
+} // dump
+
+/**
+ * Change the baud rate, back to the default unless the host
+ * synchronizes at the new rate within BAUD_TIMEOUT ms
+ * @param brg       baud rate generator divisor
+ */
+void baud( uint16_t brg)
+{
+    uint16_t t = BAUD_TIMEOUT;
+    uint8_t  prev = 0;
+    uint8_t  b;
+
+    EUSART_SetBRG( brg);            // after the acknowledge is out
+    INTCONbits.TMR0IF = 0;
+    while( t > 0)
+    {
+        if ( EUSART_DataReady)
+        {
+            b = getch();
+            if (( prev == STX) && ( b == cmdSYNC))
+            {
+                seq = 0;
+                ack( cmdSYNC);      // at the new rate
+                return;
+            }
+            prev = b;
+        }
+        else
+            EUSART_Receive_Task();
+
+        if ( TMR0_HasOverflowOccured())
+        {
+            INTCONbits.TMR0IF = 0;  // ~1ms tick
+            t--;
+        }
+    }
+    EUSART_SetBRG( BRG_BOOT);
+} // baud
+
+/**
+ * Switch between the reset clock and the boot mode clock, keeping
+ * the default baud rate and the ~1ms TMR0 tick
+ * @param fast      true for the boot mode clock (PLL)
+ */
+void speed( bool fast)
+{
+    while( !TX1STAbits.TRMT)
+        EUSART_Receive_Task();      // last byte out at the old clock
+    OSCILLATOR_SetPLL( fast);       // waits for the PLL lock (PLLR)
+    EUSART_SetBRG( fast ? BRG_BOOT : BRG_RESET);    // for the clock now running
+    OPTION_REGbits.PS = fast ? TMR0_PS_BOOT : TMR0_PS_RESET;
+    INTCONbits.TMR0IF = 0;
+    T1CON = fast ? T1CON_BOOT : 0;  // statistics timer, off for the app
+} // speed
+
+
+/**
+ * Write a data EEPROM byte, receiving while it completes (~4ms)
+ * @param add       address
+ * @param b         byte
+ */
+void eeSave( uint8_t add, uint8_t b)
+{
+    EEPROM_start( add, b);
+    while( EEPROM_busy())
+        EUSART_Receive_Task();      // keep receiving
+} // eeSave
+
+/**
+ * Set or clear the application valid marker, written only if it changes
+ * @param valid     true once the application is whole
+ */
+void validate( bool valid)
+{
+    if ( valid != appValid)
+    {
+        eeSave( EE_APP, valid ? APP_VALID : 0xFF);
+        appValid = valid;
+    }
+} // validate
+
+/**
+ * Read a word from data EEPROM
+ * @param add       address of the lsb
+ * @return          word
+ */
+uint16_t load16( uint8_t add)
+{
+    return EEPROM_read( add) | (( uint16_t)EEPROM_read( add+1) << 8);
+} // load16
+
+/**
+ * Write a word to data EEPROM, only the bytes that change
+ * @param add       address of the lsb
+ * @param w         word
+ */
+void save16( uint8_t add, uint16_t w)
+{
+    if ( EEPROM_read( add) != ( uint8_t)w)
+        eeSave( add, w);
+    if ( EEPROM_read( add+1) != ( uint8_t)( w >> 8))
+        eeSave( add+1, w >> 8);
+} // save16
+
+/**
+ * Save the checkpoint row count, if it changed
+ */
+void checkpoint( void)
+{
+    if ( checkDirty)
+    {
+        save16( EE_CHECK_ROWS, checkRows);
+        checkDirty = false;
+    }
+} // checkpoint
+
+/**
+ * Wait for the start of a command, the checkpoint is saved once
+ * the line stayed idle CHECK_IDLE ms
+ */
+void waitSTX( void)
+{
+    uint8_t idle;
+
+    do {
+        idle = 0;
+        INTCONbits.TMR0IF = 0;
+        while( !EUSART_DataReady)
+        {
+            EUSART_Receive_Task();
+            if ( TMR0_HasOverflowOccured())
+            {
+                INTCONbits.TMR0IF = 0;  // ~1ms tick
+                if ( ++idle == CHECK_IDLE)
+                    checkpoint();
+            }
+        }
+    } while( STX != getch());
+} // waitSTX
+
+/**
+ * Write a burst of data EEPROM bytes as they are received, each write
+ * overlaps receiving the next bytes, the bootloader locations are kept
+ * @param add       first address
+ * @param count     number of bytes (up to EE_BURST, more are drained only)
+ */
+void eeWrite( uint16_t add, uint16_t count)
+{
+    uint8_t b;
+
+    if ( count > EE_BURST)
+    {   // corrupted, or would overrun the receive buffer
+        while( count-- > 0)
+            getch();
+        return;
+    }
+    while( count-- > 0)
+    {
+        b = getch();
+        while( EEPROM_busy())
+            EUSART_Receive_Task();  // keep receiving
+        if (( add < EE_RESERVED) && ( EEPROM_read( add) != b))
+            EEPROM_start( add, b);
+        add++;
+    }
+    while( EEPROM_busy())
+        EUSART_Receive_Task();
+} // eeWrite
+
+/**
+ * Send a range of data EEPROM
+ * @param add       first address
+ * @param count     number of bytes
+ */
+void eeRead( uint8_t add, uint16_t count)
+{
+    while( count-- > 0)
+    {
+        putch( EEPROM_read( add++));
+    }
+} // eeRead
+
+/**
+ * Receive and store the bus addresses, only a checked pair is written,
+ * NODE and GROUP 1..0xFE or EUSART_ADDR_NONE, never the broadcast address
+ */
+void setNode( void)
+{
+    uint8_t node = getch();
+    uint8_t group = getch();
+
+    if (( uint8_t)( node + group + getch()) != 0)
+        return;                     // corrupted
+    if (( node == EUSART_ADDR_BROADCAST) || ( group == EUSART_ADDR_BROADCAST))
+        return;
+    if ( EEPROM_read( EE_NODE) != node)
+        eeSave( EE_NODE, node);
+    if ( EEPROM_read( EE_GROUP) != group)
+        eeSave( EE_GROUP, group);
+} // setNode
+
+/**
+ * Erase a range of rows, the bootloader is never erased
+ * @param add       address (16-bit unsigned) in the first row
+ * @param count     number of rows
+ */
+void erase( uint16_t add, uint16_t count)
+{
+    uint16_t t;
+
+    validate( false);
+    add &= ~FLASH_ROWMASK;
+    while(( count-- > 0) && ( add < BOOT_START))
+    {
+        t = TMR1;
+        FLASH_erase( add);
+        timing( &eraseTiming, t);
+        EUSART_Receive_Task();
+        add += FLASH_ROWSIZE;
+    }
+} // erase
+
+/**
+ * Receive a block of packed 14-bit words
+ * @param count     number of words
+ * @param pdata     array of words (16-bit unsigned)
+ */
+void get_packed( uint16_t count, uint16_t* pdata)
+{
+    uint8_t  b, c = 0;              // c: bits carried into the next word
+    uint8_t  lo, hi;
+    uint8_t  phase = 0;             // word in the group, 4 words in 7 bytes
+
+    // byte wide, constant shifts only
+    while ( count-- > 0)
+    {
+        b = getb();
+        switch ( phase)
+        {
+        case 0:                     // 8 + 6 bits
+            lo = b;
+            b = getb();
+            hi = b & 0x3F;
+            c = b >> 6;
+            break;
+        case 1:                     // 2 + 8 + 4 bits
+            lo = c | ( uint8_t)( b << 2);
+            hi = b >> 6;
+            b = getb();
+            hi |= ( uint8_t)(( b & 0x0F) << 2);
+            c = b >> 4;
+            break;
+        case 2:                     // 4 + 8 + 2 bits
+            lo = c | ( uint8_t)( b << 4);
+            hi = b >> 4;
+            b = getb();
+            hi |= ( uint8_t)(( b & 0x03) << 4);
+            c = b >> 2;
+            break;
+        default:                    // 6 + 8 bits
+            lo = c | ( uint8_t)( b << 6);
+            hi = b >> 2;
+            break;
+        }
+        phase = ( phase + 1) & 3;
+        *pdata++ = (( uint16_t)hi << 8) | lo;
+    }
+} // get_packed
+
+/**
+ * Receive a block of run length encoded words
+ * @param count     number of words
+ * @param pdata     array of words (16-bit unsigned)
+ */
+void get_rle( uint16_t count, uint16_t* pdata)
+{
+    uint8_t  t, n;
+    uint16_t w;
+
+    while ( count > 0)
+    {
+        t = getb();                 // token
+        n = ( t & 0x7F) + 1;
+        if ( n > count)             // corrupted, do not overflow data[]
+            n = count;
+        count -= n;
+        if ( t & 0x80)
+        {   // repeat run
+            w = getw();
+            while ( n-- > 0)
+                *pdata++ = w;
+        }
+        else while ( n-- > 0)       // literal run
+        {
+            *pdata++ = getw();
+        }
+    }
+} // get_rle
 
 /**
  * Receive a block of data (words)
  * @param pcount    pointer to counter (words)
  * @param pdata     array of words (16-bit unsigned)
+ * @return          DATA_LEN flags (WR_xxx)
  */
-void get_data( uint16_t* pcount, uint16_t* pdata)
+uint16_t get_data( uint16_t* pcount, uint16_t* pdata)
 {
     uint16_t count = getw();       // get the word count
+    uint16_t flags = count & WR_FLAGS;
+    count &= ~WR_FLAGS;
+    if ( count > FLASH_ROWSIZE)    // drop corrupted frames (no overflow)
+    {
+        count = 0;
+        flags = 0;
+    }
     *pcount = count;
 
-    while ( count-- > 0)  // read each word
+    if ( flags & WR_PACKED)
+        get_packed( count, pdata);
+    else if ( flags & WR_RLE)
+        get_rle( count, pdata);
+    else while ( count-- > 0)  // read each word
     {
         *pdata++ = getw();
     }
+    return flags;
 } // get_data
 
 
 /**
- * Write a block of data to flash
+ * Write a block of data to flash, rows of the bootloader are never touched
  * @param add       address (16-bit unsigned)
  * @param count     number of words
  * @param data      arrray of words
+ * @param flags     WR_ERASE to erase the row first
  */
-void write( uint16_t add, uint16_t count, uint16_t* data)
+void write( uint16_t add, uint16_t count, uint16_t* data, uint16_t flags)
 {
-    // write latches
-    while( count-- > 1)
+    uint16_t t, a, w;
+
+    validate( false);
+    checkRows++;                            // for the checkpoint
+    checkDirty = true;
+    if (( add >= BOOT_START) || (( add & FLASH_ROWMASK) + count > FLASH_ROWSIZE))
+        return;                             // boot rows, or would latch past the row
+    if ( flags & WR_ERASE)
     {
-        FLASH_write( add++, *data++, 1);  // latch
+        t = TMR1;
+        FLASH_erase( add);                  // the row containing add
+        timing( &eraseTiming, t);
+    }
+    if ( count == 0)
+        return;
+    // write latches, the whole row: only a row write blanks them, after a
+    // reset they are not, so the words around a trimmed row are latched blank
+    for( a = add & ~FLASH_ROWMASK; ( a & FLASH_ROWMASK) != FLASH_ROWMASK; a++)
+    {
+        w = 0x3FFF;
+        if (( a >= add) && ( count > 0))
+        {
+            w = *data++;
+            count--;
+        }
+        FLASH_write( a, w, 1);              // latch
+        EUSART_Receive_Task();
     }
     // write last word and entire row
-    FLASH_write( add, *data++, 0);          // write
+    w = ( count > 0) ? *data : 0x3FFF;
+    t = TMR1;
+    FLASH_write( a, w, 0);                  // write
+    timing( &writeTiming, t);
 }
 
 void main(void)
 {
     uint16_t count;
     uint16_t add;
+    uint16_t flags;
+    uint8_t  s;
+    uint8_t  c;
 
     SYSTEM_Initialize();
-    while( !TMR0_HasOverflowOccured());     // wait for 1ms
 
-    // check CS if not active (high) -> run the app
-    if ( P_CS_GetValue())  
+    // application whole, not asking for boot mode, and CS not active (high)
+    // -> run the app, a low CS is checked again once the pull-up settled
+    appValid = ( EEPROM_read( EE_APP) == APP_VALID);
+    if ( appValid && ( EEPROM_read( EE_BOOT) != BOOT_REQUEST))
     {
-        P_LED_SetLow();
-        runApp();
+        if ( !P_CS_GetValue())
+            while( !TMR0_HasOverflowOccured()); // wait for 1ms
+        if ( P_CS_GetValue())
+        {
+            P_LED_SetLow();
+            runApp();
+        }
     }
 
-    // if CS is active (low) -> boot
+    // if CS is active (low), no valid app or a request -> boot, at full speed
+    speed( true);
+    checkId = load16( EE_CHECK_ID);
+    checkRows = load16( EE_CHECK_ROWS);
+    if ( checkRows == 0xFFFF)               // never saved
+        checkRows = 0;
+    add = EEPROM_read( EE_NODE);
+    if ( add != EUSART_ADDR_NONE)           // on a bus, wait for the address
+        EUSART_SetAddress( add, EEPROM_read( EE_GROUP));
     while( 1)
     {
         // wait for a start command
-        while ( STX != getch()){
-        };
+        waitSTX();
         P_LED_Toggle();
         // receive the command and dispatch
-        switch( getch()){
+        c = getch();
+        TMR1 = 0;                   // time it, see timeCommand()
+        PIR1bits.TMR1IF = 0;
+        switch( c){
             case cmdSYNC:           // synchronize
+                seq = 0;            // restart the windowed write sequence
                 ack( cmdSYNC);      // acknowledge immediately
                 break;
             case cmdBOOT:           // stay in bootloader mode
@@ -240,29 +1028,131 @@ void main(void)
             case cmdINFO:           // return info record
                 info();
                 break;
+            case cmdIDENT:          // return the info record key fields
+                ack( cmdIDENT);
+                putw( FLASH_readConfig( DEVICE_ID));
+                putw( BOOT_REVISION);
+                putw( CAPS);
+                putw( BOOT_START);
+                putw( FLASH_ROWSIZE);
+                break;
+            case cmdSTATS:          // return statistics
+                ack( cmdSTATS);
+                stats();
+                break;
+            case cmdBAUD:           // change baud rate
+                add = getw();       // get the divisor
+                ack( cmdBAUD);
+                baud( add);
+                break;
+            case cmdCRC:            // CRC of a flash range
+                add = getw();       // get address (word)
+                getw();             // discard two high bytes
+                count = getw();     // get the number of words
+                ack( cmdCRC);
+                putw( crc( add, count));
+                break;
+            case cmdREAD:           // read a flash range
+                add = getw();       // get address (word)
+                getw();             // discard two high bytes
+                count = getw();     // get the number of words
+                ack( cmdREAD);
+                dump( add, count);
+                break;
+            case cmdHASH:           // CRC of each row in a range
+                add = getw();       // get address (word)
+                getw();             // discard two high bytes
+                count = getw();     // get the number of rows
+                ack( cmdHASH);
+                hash( add, count);
+                break;
+            case cmdNODE:           // set the bus addresses
+                setNode();
+                ack( cmdNODE);
+                putch( EEPROM_read( EE_NODE));  // read back, as stored
+                putch( EEPROM_read( EE_GROUP));
+                break;
+            case cmdVALID:          // set/clear the application marker
+                validate( getch() != 0);
+                ack( cmdVALID);
+                break;
+            case cmdCHECK:          // start or query the checkpoint
+                add = getw();       // image ID
+                s = getch();        // start
+                count = checkRows;  // answer the previous one
+                flags = checkId;
+                if ( s)
+                {
+                    checkId = add;
+                    checkRows = 0;
+                    save16( EE_CHECK_ID, checkId);
+                    checkDirty = true;
+                    checkpoint();
+                }
+                ack( cmdCHECK);
+                putw( flags);
+                putw( count);
+                break;
+            case cmdEEWRITE:        // write data EEPROM
+                add = getw();       // get address (byte)
+                getw();             // discard two high bytes
+                count = getw();     // get the number of bytes
+                eeWrite( add, count);
+                ack( cmdEEWRITE);
+                break;
+            case cmdEEREAD:         // read data EEPROM
+                add = getw();       // get address (byte)
+                getw();             // discard two high bytes
+                count = getw();     // get the number of bytes
+                if ( count > EEPROM_SIZE)
+                    count = EEPROM_SIZE;    // each byte once at most
+                ack( cmdEEREAD);
+                eeRead( add, count);
+                break;
             case cmdREBOOT:         // run application
+                if ( EEPROM_read( EE_BOOT) != 0xFF)
+                    EEPROM_write( EE_BOOT, 0xFF);   // request served
+                checkpoint();
+                speed( false);      // at the reset clock
                 runApp();
                 break;
-            case cmdERASE:          // erase block
+            case cmdERASE:          // erase blocks
                 add = getw();       // get address (word)
                 getch(); getch();   // discard two high bytes
-                FLASH_erase( add);
+                count = getw();     // get the number of blocks (rows)
+                erase( add, count);
                 ack( cmdERASE);
                 break;
             case cmdWRITE:          // write block
                 add = getw();       // get address (word)
                 getch(); getch();   // discard two high bytes
-                get_data( &count, &data);
+                flags = get_data( &count, data);
 //                add = 0x20;
 //                for( count=0; count<32; count++)
 //                    data[count]=count;
-                write( add, count, data);
+                write( add, count, data, flags);
                 ack( cmdWRITE);
                 break;
+            case cmdWRITEW:         // windowed write block
+                chk = 0;
+                s = getb();         // get sequence number
+                add = getw();       // get address (word)
+                getw();             // discard two high bytes
+                flags = get_data( &count, data);
+                getb();             // checksum, frame must add up to zero
+                if (( chk == 0) && ( count | flags) && (( s == seq) || eusartQuiet))
+                {   // in order, or broadcast
+                    write( add, count, data, flags);
+                    seq = s + 1;
+                }
+                ack( cmdWRITEW);
+                putch( seq-1);      // last row written in order
+                break;
             default:
                 bootLoad();         // restart bootloader (avoid/keep from optimizer)
                 break;
         } // swtich
+        timeCommand( c);
     } // main loop
 } // main
 
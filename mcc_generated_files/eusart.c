@@ -49,6 +49,22 @@ SUBSTITUTE GOODS, TECHNOLOGY, SERVICES, OR ANY CLAIMS BY THIRD PARTIES
 */
 #include "eusart.h"
 
+/**
+  Section: Global Variables
+*/
+
+static uint8_t eusartRxHead = 0;
+static uint8_t eusartRxTail = 0;
+static uint8_t eusartRxBuffer[EUSART_RX_BUFFER_SIZE];
+volatile uint16_t eusartRxCount;
+uint16_t eusartOverrunCount;
+uint16_t eusartFramingCount;
+uint16_t eusartByteCount;
+uint16_t eusartOerrCount;
+bool eusartQuiet;                   // answers dropped (9-bit broadcast)
+static uint8_t eusartNode = EUSART_ADDR_NONE;
+static uint8_t eusartGroup = EUSART_ADDR_NONE;
+
 /**
   Section: EUSART APIs
 */
@@ -78,34 +94,109 @@ void EUSART_Initialize(void)
     // RC1REG 0x0; 
     RC1REG = 0x00;
 
+    // initializing the driver state
+    eusartRxHead = 0;
+    eusartRxTail = 0;
+    eusartRxCount = 0;
 }
 
 
 uint8_t EUSART_Read(void)
 {
+    uint8_t readValue  = 0;
+
+    while(0 == eusartRxCount)
+    {
+        EUSART_Receive_Task();
+    }
+
+    readValue = eusartRxBuffer[eusartRxTail++];
+    eusartRxTail &= EUSART_RX_BUFFER_SIZE-1;
+    eusartRxCount--;
+
+    return readValue;
+}
+
+void EUSART_Write(uint8_t txData)
+{
+    if(eusartQuiet)
+    {
+        return;     // another node answers, if any
+    }
 
-    while(!PIR1bits.RCIF)
+    while(0 == PIR1bits.TXIF)
+    {
+        EUSART_Receive_Task();  // keep receiving while transmitting
+    }
+
+    TXREG = txData;    // Write the data byte to the USART.
+}
+
+void EUSART_Receive_Task(void)
+{
+    while(1 == PIR1bits.RCIF)
     {
+        if(1 == RC1STAbits.FERR)
+        {
+            eusartFramingCount++;
+        }
+
+        if((1 == RC1STAbits.RX9) && (1 == RC1STAbits.RX9D))
+        {
+            // address byte - select or deselect this node
+            uint8_t address = RCREG;
+            eusartQuiet = (eusartNode != address);
+            RC1STAbits.ADDEN = eusartQuiet && (EUSART_ADDR_BROADCAST != address)
+                               && (eusartGroup != address);
+            continue;
+        }
+
+        eusartByteCount++;
+        if(EUSART_RX_BUFFER_SIZE == eusartRxCount)
+        {
+            // buffer full - drop the byte
+            eusartOverrunCount++;
+            (void)RCREG;
+            continue;
+        }
+
+        eusartRxBuffer[eusartRxHead++] = RCREG;
+        eusartRxHead &= EUSART_RX_BUFFER_SIZE-1;
+        eusartRxCount++;
     }
 
     if(1 == RC1STAbits.OERR)
     {
         // EUSART error - restart
 
+        eusartOverrunCount++;
+        eusartOerrCount++;
         RC1STAbits.CREN = 0; 
         RC1STAbits.CREN = 1; 
     }
-
-    return RCREG;
 }
 
-void EUSART_Write(uint8_t txData)
+void EUSART_SetBRG(uint16_t brg)
 {
-    while(0 == PIR1bits.TXIF)
+    while(0 == TX1STAbits.TRMT)
     {
+        EUSART_Receive_Task();
     }
 
-    TXREG = txData;    // Write the data byte to the USART.
+    SP1BRGL = brg;
+    SP1BRGH = brg >> 8;
+}
+
+void EUSART_SetAddress(uint8_t node, uint8_t group)
+{
+    eusartNode = node;
+    eusartGroup = group;
+    eusartQuiet = true;
+
+    TX1STAbits.TX9D = 0;
+    TX1STAbits.TX9 = 1;
+    RC1STAbits.ADDEN = 1;
+    RC1STAbits.RX9 = 1;
 }
 /**
   End of File
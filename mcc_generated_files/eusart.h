@@ -54,6 +54,7 @@ SUBSTITUTE GOODS, TECHNOLOGY, SERVICES, OR ANY CLAIMS BY THIRD PARTIES
 #include <xc.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "../Device.h"
 
 #ifdef __cplusplus  // Provide C++ Compatibility
 
@@ -66,7 +67,30 @@ SUBSTITUTE GOODS, TECHNOLOGY, SERVICES, OR ANY CLAIMS BY THIRD PARTIES
   Section: Macro Declarations
 */
 
-#define EUSART_DataReady  (PIR1bits.RCIF)
+#define EUSART_DataReady  (eusartRxCount)
+
+#if FLASH_ROWSIZE > 32
+#define EUSART_RX_BUFFER_SIZE 256   // power of 2, holds a full row frame
+#else
+#define EUSART_RX_BUFFER_SIZE 128   // power of 2, holds a full row frame
+#endif
+
+#define EUSART_BAUD_DEFAULT   19200
+#define EUSART_BRG(fosc, baud)  ((((fosc)/4) + ((baud)/2)) / (baud) - 1)  // BRG16, BRGH
+
+#define EUSART_ADDR_BROADCAST 0x00  // 9-bit address of every node
+#define EUSART_ADDR_NONE      0xFF  // no node/group address (erased EEPROM)
+
+/**
+  Section: Data Type Definitions
+*/
+
+extern volatile uint16_t eusartRxCount;
+extern uint16_t eusartOverrunCount;
+extern uint16_t eusartFramingCount;
+extern uint16_t eusartByteCount;
+extern uint16_t eusartOerrCount;
+extern bool eusartQuiet;
 
 /**
   Section: EUSART APIs
@@ -114,6 +138,84 @@ void EUSART_Initialize(void);
 */
 uint8_t EUSART_Read(void);
 
+/**
+  @Summary
+    Moves the received bytes from the EUSART FIFO to the receive buffer.
+
+  @Description
+    This routine drains the 2-byte hardware FIFO into the receive ring
+    buffer, counting framing errors (FERR) and overruns (OERR) in
+    eusartFramingCount and eusartOverrunCount. A byte received while the
+    ring buffer is full is counted as an overrun and dropped.
+    eusartByteCount counts the data bytes received, eusartOerrCount the
+    hardware overruns alone.
+    The interrupt vector belongs to the application, so the bootloader
+    calls this routine from every busy loop instead of an ISR.
+    In 9-bit mode address bytes select the node, see EUSART_SetAddress().
+
+  @Preconditions
+    EUSART_Initialize() function should have been called
+    before calling this function.
+
+  @Param
+    None
+
+  @Returns
+    None
+*/
+void EUSART_Receive_Task(void);
+
+/**
+  @Summary
+    Changes the baud rate generator divisor.
+
+  @Description
+    This routine waits for the transmit shift register to empty, so that
+    a pending byte goes out at the old rate, then loads SP1BRGH:SP1BRGL.
+    With BRG16 and BRGH set the baud rate is Fosc/(4*(brg+1)).
+
+  @Preconditions
+    EUSART_Initialize() function should have been called
+    before calling this function.
+
+  @Param
+    brg  - 16-bit baud rate generator divisor
+
+  @Returns
+    None
+*/
+void EUSART_SetBRG(uint16_t brg);
+
+/**
+  @Summary
+    Joins a 9-bit addressed (multi-drop) bus.
+
+  @Description
+    This routine switches the EUSART to 9-bit mode with address detect
+    (RX9, ADDEN) and 9-bit transmission with the 9th bit clear (TX9).
+    Bytes received with the 9th bit set are addresses, handled by
+    EUSART_Receive_Task() and never passed to the receive buffer:
+      node              - the following bytes are received and answered
+      group, broadcast  - the following bytes are received, eusartQuiet is
+                          set and EUSART_Write() drops the answers, so that
+                          many nodes execute the same commands
+      any other         - ADDEN is set again, the hardware ignores the
+                          following bytes
+    The node starts deselected, waiting for its address.
+
+  @Preconditions
+    EUSART_Initialize() function should have been called
+    before calling this function.
+
+  @Param
+    node  - node address, 1..0xFE
+    group - group address, 1..0xFE or EUSART_ADDR_NONE
+
+  @Returns
+    None
+*/
+void EUSART_SetAddress(uint8_t node, uint8_t group);
+
  /**
   @Summary
     Writes a byte of data to the EUSART.
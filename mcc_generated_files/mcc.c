@@ -89,6 +89,24 @@ void OSCILLATOR_Initialize(void)
     
 }
 
+void OSCILLATOR_SetPLL(bool enable)
+{
+    if(enable)
+    {
+        // SPLLEN enabled; SCS FOSC (INTOSC); IRCF 8MHz_HF; 4x PLL -> 32MHz
+        OSCCON = 0xF0;
+        // wait for the PLL to lock
+        while(0 == OSCSTATbits.PLLR)
+        {
+        }
+    }
+    else
+    {
+        // back to the reset settings
+        OSCILLATOR_Initialize();
+    }
+}
+
 /**
  End of File
 */
\ No newline at end of file
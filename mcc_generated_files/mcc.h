@@ -54,6 +54,7 @@ SUBSTITUTE GOODS, TECHNOLOGY, SERVICES, OR ANY CLAIMS BY THIRD PARTIES
 #include "tmr0.h"
 
 #define _XTAL_FREQ  8000000
+#define _XTAL_FREQ_BOOT  32000000   // bootloader mode, 4x PLL
 
 /**
  * @Param
@@ -81,6 +82,19 @@ void SYSTEM_Initialize(void);
  */
 void OSCILLATOR_Initialize(void);
 
+/**
+ * @Param
+    enable - true to run from the 4x PLL (_XTAL_FREQ_BOOT),
+             false to restore the OSCILLATOR_Initialize() settings
+ * @Returns
+    none
+ * @Description
+    Switches the system clock, waits for the PLL to lock when enabled
+ * @Example
+    OSCILLATOR_SetPLL(true);
+ */
+void OSCILLATOR_SetPLL(bool enable);
+
 
 #endif	/* MCC_H */
 /**
@@ -0,0 +1,375 @@
+#!/usr/bin/python
+#
+# Flashing benchmark, SerialBoot16.py against the simulator
+#
+# Flashes Buck.hex and synthetic dense, sparse and repetitive images with
+# each protocol mode at each baud rate, a fresh (blank) simulated device per
+# run, and reports:
+#   time to flash   connect to reboot, split by phase
+#   payload rate    image bytes (below the bootloader) per second
+#   efficiency      image bytes per byte sent on the wire (> 1 with RLE,
+#                   the delta mode counts the whole image)
+#   latency         per command histogram, submit to response, so windowed
+#                   writes include the time spent queued behind the window
+#   launch          reset to application start (launch mode: CS released,
+#                   the simulator power cycled, then updated again through
+#                   the wake-up text)
+# the results go to a JSON file (-o) for tracking regressions
+#
+# Usage: bench.py [-b bauds] [-m modes] [-i images] [-o file.json]
+#                 [-E erase_ms] [-W write_ms]
+#      -b 115200,500000         baud rates
+#      -m row,window,...        protocol modes (see Modes), default all
+#      -i buck,dense,...        images (see Images) or hex files
+#      -o bench.json            results
+#      -E, -W                   stall times passed to the simulator
+#
+import os
+import sys
+import time
+import json
+import random
+import signal
+import getopt
+import tempfile
+import threading
+import subprocess
+import intelhex
+
+Here = os.path.dirname( os.path.abspath( __file__))
+sys.path.insert( 0, os.path.join( Here, '..', 'SerialBoot16'))
+import SerialBoot16 as sb
+
+Sim         = os.path.join( Here, 'sim')
+AppWords    = 0         # BOOT_START, from the simulator INFO (Layout)
+RowWords    = 0         # FLASH_ROWSIZE, same
+Seed        = 1         # synthetic images are the same on every run
+Limit       = 120       # s, a run still going is killed (and fails)
+
+# protocol modes: capabilities the host may use, max rows in flight
+Base        = sb.capSTATS | sb.capBAUD | sb.capCRC | sb.capREAD | sb.capHASH | sb.capBUS \
+            | sb.capVALID | sb.capCHECK | sb.capEEPROM | sb.capIDENT
+Modes       = [
+    ( 'row',    Base,                                           1),
+    ( 'range',  Base | sb.capERASEN,                            1),
+    ( 'window', Base | sb.capERASEN | sb.capWRITEW,             sb.Window),
+    ( 'erasew', Base | sb.capERASEW | sb.capWRITEW,             sb.Window),
+    ( 'packed', Base | sb.capERASEW | sb.capWRITEW | sb.capPACK, sb.Window),
+    ( 'rle',    0xffff,                                         sb.Window),
+    ( 'delta',  0xffff,                                         sb.Window),  # one row changed
+    ( 'launch', 0xffff,                                         sb.Window),  # CS high, see Launch
+    ]
+
+# latency histogram bucket upper bounds (ms), the last one is open
+Buckets     = [ 0.5, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512]
+
+# phases: outermost host function running -> time accounted to
+Phases      = [ ( 'ConnectLoop', 'connect'), ( 'Sync', 'connect'), ( 'Info', 'connect'),
+                ( 'Boot', 'connect'), ( 'SetBaud', 'baud'), ( 'ChangedBlocks', 'delta'),
+                ( 'EraseBlocks', 'erase'), ( 'Erase', 'erase'), ( 'WriteWindow', 'write'),
+                ( 'WriteRow', 'write'), ( 'Verify', 'verify'), ( 'Stats', 'stats'),
+                ( 'Identify', 'connect'), ( 'Validate', 'validate'),
+                ( 'Checkpoint', 'checkpoint'), ( 'EEProgram', 'eeprom'), ( 'ReBoot', 'reboot')]
+# phases in the report, in order
+Columns     = [ 'connect', 'baud', 'delta', 'erase', 'write', 'verify', 'validate',
+                'checkpoint', 'eeprom', 'reboot']
+
+#----------------------------------------------------------------------------
+# synthetic images
+
+def Words( d, waddr, words):
+    for x, w in enumerate( words):
+        d[ (waddr+x)*2]   = w & 0xff
+        d[ (waddr+x)*2+1] = w >> 8
+
+def Dense( rnd):
+    # every word used, no runs (worst case for RLE)
+    d = intelhex.IntelHex()
+    Words( d, 0, [ rnd.randrange( 0x3fff) for x in xrange( AppWords-2)])
+    return d
+
+def Sparse( rnd):
+    # small functions scattered over the flash, most rows blank or partial,
+    # and a block of data EEPROM settings
+    d = intelhex.IntelHex()
+    Words( d, 0, [ 0x3180, 0x2820])         # reset vector
+    for x in xrange( 24):
+        n = rnd.randrange( 5, 40)
+        Words( d, rnd.randrange( RowWords, AppWords-2-n),
+               [ rnd.randrange( 0x3fff) for y in xrange( n)])
+    Words( d, sb.EEBase / 2, [ rnd.randrange( 256) for x in xrange( 48)])
+    return d
+
+def Repetitive( rnd):
+    # retlw tables and constant runs (best case for RLE)
+    d = intelhex.IntelHex()
+    words = []
+    while len( words) < AppWords-2:
+        w = rnd.choice([ 0x3400 | rnd.randrange( 256), 0x0000, 0x3fff, 0x0008])
+        words += [ w] * rnd.randrange( 4, 64)
+    Words( d, 0, words[:AppWords-2])
+    return d
+
+Images = [ ( 'buck', None), ( 'dense', Dense), ( 'sparse', Sparse), ( 'repetitive', Repetitive)]
+
+def MakeImage( name, tmp):
+    # hex file of a named image (or an existing file)
+    for n, f in Images:
+        if n != name: continue
+        if not f:
+            return os.path.join( Here, '..', 'SerialBoot16', 'Buck.hex')
+        path = os.path.join( tmp, name + '.hex')
+        f( random.Random( Seed)).tofile( path, format='hex')
+        return path
+    return name
+
+#----------------------------------------------------------------------------
+# instrumented host
+
+class Run:
+    # state of the run in progress, filled in by the wrappers
+    phases = {}
+    stack = 0
+    latency = []
+
+def Phase( f, phase):
+    # time f, unless it runs inside another phase
+    def wrapper( *args, **kw):
+        Run.stack += 1
+        start = time.time()
+        try:
+            return f( *args, **kw)
+        finally:
+            Run.stack -= 1
+            if not Run.stack:
+                Run.phases[ phase] = Run.phases.get( phase, 0) + time.time() - start
+    return wrapper
+
+def Instrument( mask):
+    # wrap the host functions once, the capabilities mask is applied per run
+    if not hasattr( sb, 'benchInfo'):
+        for name, phase in Phases:
+            setattr( sb, name, Phase( getattr( sb, name), phase))
+        sb.benchInfo = sb.Info
+        sb.benchConnect = sb.Connect
+    def info():
+        sb.benchInfo()
+        sb.info.Caps &= Run.mask
+    def connect( port=None):
+        sb.benchConnect( port)
+        sb.info.io.latency = Run.latency
+    Run.mask = mask
+    sb.Profiles = None          # always INFO, the mask applies to it
+    sb.Info = Phase( info, 'connect')
+    sb.Connect = connect
+
+def Payload( image):
+    return len([ a for a in image.addresses() if a < AppWords*2])
+
+def Modify( image):
+    # change one word in the middle of the image, for the delta run
+    a = ( AppWords / 2) * 2
+    image[ a] ^= 0x01
+    image[ a+1] &= 0x3f
+
+#----------------------------------------------------------------------------
+
+def Start( link, flash, stalls, log=os.devnull):
+    p = subprocess.Popen([ Sim, '-l', link, '-f', flash] + stalls,
+                         stdout=open( os.devnull, 'w'), stderr=open( log, 'w'))
+    while not os.path.exists( link):
+        time.sleep( 0.01)
+    return p
+
+def Stop( p):
+    p.terminate()
+    p.wait()
+
+def Layout( tmp, stalls):
+    # application and row size of the simulator build, as INFO reports them
+    global AppWords, RowWords
+    link = os.path.join( tmp, 'tty')
+    p = Start( link, os.path.join( tmp, 'flash.bin'), stalls)
+    out = sys.stdout
+    sys.stdout = open( os.devnull, 'w')
+    try:
+        sb.Connect( link)
+        if not sb.Sync( 4):
+            raise sb.ProtocolError( 'the simulator does not answer')
+        sb.Info()
+        AppWords, RowWords = sb.info.BootStart, sb.info.WriteBlock
+    finally:
+        sys.stdout.close()
+        sys.stdout = out
+        sb.Close()
+        Stop( p)
+
+def Launch( p, log):
+    # power cycle the simulator (CS released, application valid), return
+    # the time (us) from reset to the application starting, None if it did not
+    n = open( log).read().count( 'run application')
+    p.send_signal( signal.SIGUSR1)
+    end = time.time() + 1
+    while time.time() < end:
+        lines = [ l for l in open( log) if 'run application' in l]
+        if len( lines) > n:
+            return float( lines[-1].split()[-4])    # ..., <us> us after reset
+        time.sleep( 0.01)
+    return None
+
+def Bench( imageName, path, mode, baud, tmp, stalls):
+    name, mask, window = mode
+    link = os.path.join( tmp, 'tty')
+    flash = os.path.join( tmp, 'flash.bin')
+    log = os.path.join( tmp, 'sim.log')
+    if os.path.exists( flash): os.remove( flash)
+    launch = name == 'launch'               # the application runs between updates
+    p = Start( link, flash, stalls + ([ '-c', '1'] if launch else []), log)
+    watchdog = threading.Timer( Limit, p.kill)
+    watchdog.start()
+    Run.phases = {}
+    Run.latency = []
+    out = sys.stdout
+    sys.stdout = open( os.devnull, 'w')     # the host is verbose
+    try:
+        sb.Load( path)
+        image = sb.info.dHex
+        Instrument( mask)
+        sb.Window = window
+        delta = name == 'delta'
+        launched = None
+        if delta:                           # program, then update one row
+            sb.Program( link, baud)
+            sb.Load( path)
+            image = sb.info.dHex
+            Modify( image)
+            Run.phases = {}
+            Run.latency = []
+        if launch:                          # program, power on to the application,
+            sb.Program( link, baud)         # update again through the wake-up text
+            sb.Close()
+            launched = Launch( p, log)
+            sb.WakeUp = 'boot\n'
+            Run.phases = {}
+            Run.latency = []
+        sb.info.io = None
+        start = time.time()
+        ok = sb.Program( link, baud, delta) # an exception fails the bench
+        ok = ok and ( launched is not None or not launch)
+        elapsed = time.time() - start
+        sent = sb.info.io.sent if sb.info.io else 0
+    finally:
+        sys.stdout.close()
+        sys.stdout = out
+        sb.WakeUp = None
+        watchdog.cancel()
+        sb.Close()
+        Stop( p)
+    payload = Payload( image)
+    return {
+        'image': imageName, 'mode': name, 'baud': baud, 'ok': bool( ok),
+        'time': elapsed, 'phases': Run.phases,
+        'payload': payload, 'wire': sent,
+        'rate': payload / elapsed,
+        'efficiency': float( payload) / sent if sent else 0,
+        'latency': Histograms( Run.latency),
+        'launch_us': launched,
+        }
+
+def Percentile( v, p):
+    return v[ min( len( v)-1, int( p * len( v)))]
+
+def Histograms( latency):
+    # per command: count, percentiles (ms) and bucket counts
+    h = {}
+    for cmd in sorted( set( c for c, t in latency)):
+        v = sorted( t * 1000 for c, t in latency if c == cmd)
+        counts = [ 0] * ( len( Buckets) + 1)
+        for t in v:
+            counts[ len([ b for b in Buckets if t > b])] += 1
+        h[ cmd] = { 'count': len( v), 'p50': Percentile( v, 0.5),
+                    'p95': Percentile( v, 0.95), 'max': v[-1], 'buckets': counts}
+    return h
+
+def Merge( runs):
+    # latency histograms of several runs added up (percentiles: the worst)
+    h = {}
+    for r in runs:
+        for cmd, x in r[ 'latency'].items():
+            if cmd not in h:
+                h[ cmd] = dict( x, buckets=list( x[ 'buckets']))
+                continue
+            m = h[ cmd]
+            m[ 'count'] += x[ 'count']
+            m[ 'buckets'] = [ a+b for a, b in zip( m[ 'buckets'], x[ 'buckets'])]
+            for k in [ 'p50', 'p95', 'max']:
+                m[ k] = max( m[ k], x[ k])
+    return h
+
+def Report( runs):
+    print
+    print "%-10s %-7s %7s %3s %8s %9s %5s  %s" % ( 'image', 'mode', 'baud', 'ok',
+        'time s', 'bytes/s', 'eff', '/'.join( Columns) + ' s')
+    for r in runs:
+        ph = r[ 'phases']
+        print "%-10s %-7s %7d %3s %8.2f %9.0f %5.2f  %s" % ( r[ 'image'], r[ 'mode'],
+            r[ 'baud'], 'ok' if r[ 'ok'] else 'BAD', r[ 'time'], r[ 'rate'], r[ 'efficiency'],
+            '/'.join( '%.2f' % ph.get( k, 0) for k in Columns))
+    for r in runs:
+        if r[ 'mode'] == 'launch':
+            print "%-10s launch  %7d  application started %s us after reset" % ( r[ 'image'],
+                r[ 'baud'], '%.0f' % r[ 'launch_us'] if r[ 'launch_us'] is not None else 'never')
+    print
+    print "Latency (ms) per command, buckets up to %s ms and above" % ', '.join( '%g' % b for b in Buckets)
+    keys = []
+    for r in runs:
+        if ( r[ 'mode'], r[ 'baud']) not in keys:
+            keys.append(( r[ 'mode'], r[ 'baud']))
+    for mode, baud in keys:
+        h = Merge([ r for r in runs if r[ 'mode'] == mode and r[ 'baud'] == baud])
+        print "%s @ %d" % ( mode, baud)
+        for cmd in sorted( h):
+            x = h[ cmd]
+            print "  %s %6d  p50 %7.2f  p95 %7.2f  max %7.2f  |%s|" % ( cmd, x[ 'count'],
+                x[ 'p50'], x[ 'p95'], x[ 'max'], ' '.join( '%d' % n for n in x[ 'buckets']))
+
+#----------------------------------------------------------------------------
+
+if __name__ == '__main__':
+    try:
+        opts, args = getopt.getopt( sys.argv[1:], 'b:m:i:o:E:W:')
+    except getopt.GetoptError:
+        args = [ None]
+    if args:
+        print "Usage: %s [-b bauds] [-m modes] [-i images] [-o file.json] [-E erase_ms] [-W write_ms]" % sys.argv[0]
+        exit(1)
+    bauds = [ 115200, 500000]
+    modes = Modes
+    images = [ n for n, f in Images]
+    output = 'bench.json'
+    stalls = []
+    for o, a in opts:
+        if o == '-b': bauds = [ int( x) for x in a.split( ',')]
+        if o == '-m': modes = [ m for m in Modes if m[0] in a.split( ',')]
+        if o == '-i': images = a.split( ',')
+        if o == '-o': output = a
+        if o in [ '-E', '-W']: stalls += [ o, a]
+
+    tmp = tempfile.mkdtemp()
+    Layout( tmp, stalls)
+    runs = []
+    for name in images:
+        path = MakeImage( name, tmp)
+        for mode in modes:
+            for baud in bauds:
+                r = Bench( name, path, mode, baud, tmp, stalls)
+                print "%-10s %-7s %7d %s %.2fs" % ( name, mode[0], baud,
+                                                    'ok ' if r[ 'ok'] else 'BAD', r[ 'time'])
+                runs.append( r)
+    Report( runs)
+    json.dump({ 'date': time.strftime( '%Y-%m-%dT%H:%M:%S'), 'stalls': stalls,
+                'buckets_ms': Buckets, 'runs': runs},
+              open( output, 'w'), indent=1, sort_keys=True)
+    print
+    print "Results in %s" % output
+    exit( 0 if all( r[ 'ok'] for r in runs) else 1)
@@ -0,0 +1,236 @@
+#!/usr/bin/python
+#
+# Replay a wire trace recorded by SerialBoot16.py (-t) against the simulator
+# (or a port) and compare the timing
+#
+# The recorded bytes are sent again in order with the same line settings.
+# Each write waits for the device bytes the host had received before it,
+# then for the host reaction time seen in the recording, so the replay keeps
+# the data dependencies and the host gaps while the device sets its own pace.
+# A command completes when the replay has received as many bytes as the
+# recording had when that command completed.
+#
+# Usage: replay.py [-p port] [-P traced port] [-f flash.bin] [-x] [-n lines]
+#                  [-E erase_ms] [-W write_ms] trace.jsonl
+#      -p port      replay against this port, default a simulator started
+#                   with a blank flash (or -f file, left with the result)
+#      -P port      port of the trace to replay, default the first one
+#      -x           no host gaps, send as soon as the device answered
+#      -n lines     commands listed with the largest differences (10)
+#      -E, -W       stall times passed to the simulator
+#
+import os
+import sys
+import time
+import json
+import getopt
+import tempfile
+import threading
+import subprocess
+import serial
+
+Here = os.path.dirname( os.path.abspath( __file__))
+Sim         = os.path.join( Here, 'sim')
+Wait        = 1.0       # s, max wait for the device bytes before a write
+Poll        = 0.02      # reader polling period (s)
+
+def Load( name, port=None):
+    # records of one port, in order
+    recs = [ json.loads( l) for l in open( name) if l.strip()]
+    if not port and recs:
+        port = recs[0][ 'port']
+    return port, [ r for r in recs if r[ 'port'] == port]
+
+def Actions( recs):
+    # the writes with the device bytes received (recorded) before each one,
+    # the host gap after them, and the commands with their completion point
+    actions = []
+    cmds = []
+    rx = 0                  # bytes received so far
+    rxAt = 0                # time of the last one
+    txAt = 0                # time of the last write
+    for r in recs:
+        ev = r[ 'ev']
+        if ev == 'rx':
+            rx += len( r[ 'data']) / 2
+            rxAt = r[ 't']
+        elif ev == 'tx':
+            ready = max( txAt, rxAt)
+            actions.append(( 'tx', bytearray( r[ 'data'].decode( 'hex')), rx, r[ 't'] - ready))
+            txAt = r[ 't']
+        elif ev in [ 'open', 'baud', 'parity']:
+            actions.append(( ev, r, rx, 0))
+        elif ev == 'cmd':
+            cmds.append({ 'cmd': r[ 'cmd'], 'start': r[ 't'], 'tx': len( actions)})
+        elif ev == 'done':
+            c = [ x for x in cmds if x[ 'cmd'] == r[ 'cmd'] and 'rx' not in x]
+            if c:
+                c[0].update( end=r[ 't'], rx=rx, error=r[ 'error'])
+    return actions, [ c for c in cmds if 'rx' in c]
+
+class Reader:
+    # collects the device bytes, time of arrival of each chunk
+    def __init__( self, h):
+        self.h = h
+        self.data = bytearray()
+        self.times = []     # ( bytes received so far, time)
+        self.lock = threading.Condition()
+        self.running = True
+        self.thread = threading.Thread( target=self.run)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def run( self):
+        while self.running:
+            try:
+                d = self.h.read( max( 1, self.h.inWaiting()))
+            except:
+                break
+            if d:
+                with self.lock:
+                    self.data.extend( d)
+                    self.times.append(( len( self.data), time.time()))
+                    self.lock.notifyAll()
+
+    def wait( self, n, timeout):
+        # wait for n bytes, return the time the n-th arrived (None: timeout)
+        deadline = time.time() + timeout
+        with self.lock:
+            while len( self.data) < n and time.time() < deadline:
+                self.lock.wait( Poll)
+            return self.at( n)
+
+    def at( self, n):
+        if n == 0: return 0
+        for count, t in self.times:
+            if count >= n: return t
+        return None
+
+    def close( self):
+        self.running = False
+        self.thread.join()
+
+def Replay( port, actions, fast):
+    # send the writes, return their times and the reader
+    h = None
+    sent = []               # time of each action
+    late = 0                # writes sent without all the bytes expected
+    for kind, x, rx, gap in actions:
+        if kind == 'open' and h:            # reconnected, same port
+            h.baudrate = x[ 'baud']
+            h.parity = x[ 'parity']
+        elif kind == 'open':
+            h = serial.Serial( port, baudrate=x[ 'baud'])
+            h.timeout = Poll
+            h.parity = x[ 'parity']
+            h.flushInput()
+            reader = Reader( h)
+            start = time.time()
+        elif kind in [ 'baud', 'parity']:   # once the answers at the old one are in
+            reader.wait( rx, Wait)
+            h.baudrate = x.get( 'baud', h.baudrate)
+            h.parity = x.get( 'parity', h.parity)
+        else:
+            t = reader.wait( rx, Wait)
+            if t is None:
+                late += 1
+                t = time.time()
+            t = max( t, sent[-1] if sent else start)
+            if not fast:
+                while time.time() < t + gap:
+                    time.sleep( min( 0.001, t + gap - time.time()))
+            h.write( x)
+        sent.append( time.time())
+    time.sleep( Wait)       # last answers
+    reader.close()
+    h.close()
+    return start, sent, reader, late
+
+def Report( recs, actions, cmds, start, sent, reader, late, lines):
+    rec = [ r for r in recs if r[ 'ev'] == 'rx']
+    data = bytearray( ''.join( r[ 'data'] for r in rec).decode( 'hex'))
+    total = recs[-1][ 't'] - recs[0][ 't']
+    print "Session: recorded %.3f s, replayed %.3f s" % ( total, sent[-1] - start)
+    print "Sent %d writes, %d without the device bytes expected (waited %.1f s)" % (
+        len([ a for a in actions if a[0] == 'tx']), late, Wait)
+    same = 0
+    while same < min( len( data), len( reader.data)) and data[ same] == reader.data[ same]:
+        same += 1
+    if same == len( data) == len( reader.data):
+        print "Received the same %d bytes" % same
+    else:
+        print "Received %d bytes (recorded %d), first difference at byte %d" % (
+            len( reader.data), len( data), same)
+
+    # command latency, recorded vs replay
+    rows = []
+    for c in cmds:
+        if c[ 'error'] or c[ 'tx'] >= len( sent): continue
+        end = reader.at( c[ 'rx'])
+        if end is None: continue
+        begin = sent[ c[ 'tx']]
+        rows.append(( c[ 'cmd'], c[ 'end'] - c[ 'start'], end - begin, c[ 'start']))
+    print
+    print "Command  count  recorded ms  replay ms  (mean)  max diff ms"
+    for cmd in sorted( set( r[0] for r in rows)):
+        v = [ r for r in rows if r[0] == cmd]
+        print "   %s    %5d     %8.2f   %8.2f          %+8.2f" % ( cmd, len( v),
+            sum( r[1] for r in v) * 1000 / len( v), sum( r[2] for r in v) * 1000 / len( v),
+            max(( r[2] - r[1] for r in v), key=abs) * 1000)
+    print
+    print "Largest differences:"
+    print "   at s    command  recorded ms  replay ms"
+    for r in sorted( rows, key=lambda r: -abs( r[2] - r[1]))[:lines]:
+        print "%8.3f     %s      %8.2f   %8.2f" % ( r[3], r[0], r[1] * 1000, r[2] * 1000)
+    failed = len([ c for c in cmds if c[ 'error']])
+    if failed:
+        print "%d commands had failed in the recording, not compared" % failed
+
+#----------------------------------------------------------------------------
+
+if __name__ == '__main__':
+    try:
+        opts, args = getopt.getopt( sys.argv[1:], 'p:P:f:xn:E:W:')
+    except getopt.GetoptError:
+        args = []
+    if len( args) != 1:
+        print "Usage: %s [-p port] [-P traced port] [-f flash.bin] [-x] [-n lines]" % sys.argv[0],
+        print "[-E erase_ms] [-W write_ms] trace.jsonl"
+        exit(1)
+    port = None
+    traced = None
+    flash = None
+    fast = False
+    lines = 10
+    stalls = []
+    for o, a in opts:
+        if o == '-p': port = a
+        if o == '-P': traced = a
+        if o == '-f': flash = a
+        if o == '-x': fast = True
+        if o == '-n': lines = int( a)
+        if o in [ '-E', '-W']: stalls += [ o, a]
+
+    traced, recs = Load( args[0], traced)
+    if not recs:
+        print "No records for %s" % traced
+        exit(1)
+    actions, cmds = Actions( recs)
+    print "Replaying %s: %d records, %d commands" % ( traced, len( recs), len( cmds))
+
+    sim = None
+    if not port:            # start a simulator
+        tmp = tempfile.mkdtemp()
+        port = os.path.join( tmp, 'tty')
+        flash = flash or os.path.join( tmp, 'flash.bin')
+        sim = subprocess.Popen([ Sim, '-l', port, '-f', flash] + stalls,
+                               stdout=open( os.devnull, 'w'), stderr=open( os.devnull, 'w'))
+        while not os.path.exists( port):
+            time.sleep( 0.01)
+    try:
+        start, sent, reader, late = Replay( port, actions, fast)
+    finally:
+        if sim:
+            sim.terminate()
+            sim.wait()
+    Report( recs, actions, cmds, start, sent, reader, late, lines)
@@ -0,0 +1,812 @@
+/*
+ * File: sim/sim.c
+ *
+ * Host (Linux) build of the bootloader
+ *  emulates the flash self-write registers, the EUSART, TMR0, TMR1 and the clock
+ *  of the PIC16F1783 (flash sizes of the Device.h profile built) and exposes
+ *  the serial port on a pty that SerialBoot16.py can open (-p option)
+ *
+ *  the parent process owns the pty and the flash/EEPROM arrays (shared
+ *  memory), every MCU reset forks a fresh child running the firmware main()
+ *
+ *  a row erase or write halts the CPU for the stall time, the receiver keeps
+ *  going meanwhile and overruns (OERR) after two bytes, as on the device,
+ *  a data EEPROM write keeps WR set for its write time, the CPU running,
+ *  a firmware polling WR without reading the receiver overruns the same way
+ *
+ *  CS (RA5) is held low by default, the bootloader always stays; with -c 1
+ *  it is released, a valid application is launched and a stand-in for it
+ *  asks for boot mode (EE_BOOT) on the first bytes the host sends, as the
+ *  wake-up text (SerialBoot16.py -e) would have an application do;
+ *  SIGUSR1 power cycles the nodes, the MCU starts from reset with the
+ *  flash and EEPROM kept, the way the launch path at reset runs
+ *
+ *  with more than one node the parent is an RS-485 bus: what the host sends
+ *  goes to every node, tagged with the 9th bit (host parity mark/space), and
+ *  what any node sends goes back to the host
+ *
+ * Usage: sim [-l link] [-f flash.bin] [-e eeprom.bin] [-n nodes] [-a address]
+ *            [-c cs] [-E erase_ms] [-W write_ms] [-D eeprom_ms]
+ *      -l link     create a symbolic link to the pty slave
+ *      -f file     load the flash array from file, save it back on reset
+ *      -e file     same for the data EEPROM
+ *      -n nodes    number of nodes on the bus, files get a .<node> suffix
+ *      -a address  bus address of the first node (EE_NODE), the next ones
+ *                  follow, the EEPROM keeps its own by default
+ *      -c cs       CS level at reset, 0 (default) or 1 (released)
+ *      -E ms       row erase stall (default 2.5ms, 0 = none)
+ *      -W ms       row write stall (default 2.5ms, 0 = none)
+ *      -D ms       data EEPROM byte write time (default 4ms, 0 = none)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <asm/termbits.h>
+
+#include "xc.h"
+#include "sim.h"
+#include "../Flash.h"
+
+#define FLASH_BLANK     0x3FFF
+#define EEPROM_BLANK    0xFF
+#define EE_NODE         0xFF        // bus node address, see main.c
+#define EE_BOOT         0xFC        // application request, same
+#define BOOT_REQUEST    0xB0
+#define NODES_MAX       16
+#define RX_FIFO         2           // EUSART receive FIFO depth
+#define SLACK           0.005       // s, host scheduling absorbed by the line model
+#define CPU_STEP        1e-6        // s, firmware time per receiver poll
+#define FOSC            (( OSCCON & 0x80) ? 32e6 : 8e6)   // SPLLEN, 4x PLL
+#define PLL_LOCK        2e-3        // s, PLL start-up time (TPLLST) until PLLR
+
+void firmware_main( void);          // main.c compiled with -Dmain=firmware_main
+
+/******************************************************************************
+ * Registers
+ */
+uint16_t     EEADR, EEDAT;
+uint8_t      EECON2;
+EECON1bits_t sim_eecon1;
+
+INTCON_t     sim_intcon;
+PIR1_t       sim_pir1;
+OPTION_REG_t sim_option;
+uint8_t      TMR0;
+T1CON_t      sim_t1con;
+
+uint8_t      OSCCON, OSCTUNE;
+OSCSTAT_t    sim_oscstat;
+
+RC1STA_t     sim_rc1sta;
+TX1STA_t     sim_tx1sta;
+uint8_t      BAUD1CON, SP1BRGL, SP1BRGH;
+
+uint8_t LATA, LATB, LATC;
+uint8_t TRISA, TRISB, TRISC, TRISE;
+uint8_t ANSELA, ANSELB;
+uint8_t WPUA, WPUB, WPUC, WPUE;
+uint8_t APFCON;
+uint8_t RA5, RA7, LATA5, LATA7;
+
+/******************************************************************************
+ * Simulator state
+ */
+typedef struct {
+    pid_t       pid;                // MCU process
+    int         port;               // its end of the serial line
+    int         bus;                // parent end of the bus link
+    uint16_t*   flash;              // shared memory
+    uint8_t*    eeprom;
+    char        flashFile[ 256];
+    char        eepromFile[ 256];
+} node_t;
+
+static node_t       nodes[ NODES_MAX];
+static int          nodeCount = 1;
+
+static uint16_t*    flash;
+static uint8_t*     eeprom;
+static uint16_t     latch[ FLASH_ROWSIZE];  // row write latches
+
+static int          master = -1;            // pty master
+static int          port = -1;              // the MCU serial line
+static int          slave = -1;             // pty slave, for the host baud
+
+static uint8_t      rxq[ 256];              // bytes received from the pty
+static double       rxAt[ 256];             // time each byte is complete
+static uint8_t      rxErr[ 256];            // framing error
+static uint8_t      rx9[ 256];              // 9th bit
+static unsigned     rxHead, rxTail;
+static double       rxLast;
+static double       cpu;                    // firmware time, see cpuNow()
+static uint8_t      rxReg, txReg;
+static int          txPending;
+static double       txFree, tsrDone;        // TXREG and shift register free
+static unsigned     rxIdle;                 // consecutive polls, nothing else done
+static int          rxPolled;               // receiver polled since the last WR poll
+
+static double       tmr0Last;               // time of the last TMR0 overflow
+static uint16_t     tmr1;
+static double       tmr1At;                 // firmware time tmr1 was counted to
+
+static double       eraseStall = 2.5e-3;    // s, CPU halted by a row erase
+static double       writeStall = 2.5e-3;    // s, and by a row write
+static double       eepromWrite = 4e-3;     // s, data EEPROM byte write
+static double       eepromDone;             // firmware time it completes
+
+static int          cs;                     // CS level at reset (-c)
+static double       resetAt;                // time of the MCU reset
+static double       pllOn;                  // time SPLLEN was seen set, 0 = off
+
+static void stall( double s);
+static void rxFill( double timeout);
+static void rxOverrun( double end);
+
+static double now( void)
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * firmware time, advances by CPU_STEP per poll and never passes real time,
+ * a firmware descheduled by the host falls behind (up to SLACK) and catches
+ * up as the device would, instead of finding many bytes ready at once
+ */
+static double cpuNow( void)
+{
+    double t = now();
+
+    cpu += CPU_STEP;
+    if ( cpu < t - SLACK)
+        cpu = t - SLACK;
+    if ( cpu > t)
+        cpu = t;
+    return cpu;
+}
+
+/******************************************************************************
+ * Flash and data EEPROM, kept in files across runs
+ */
+static void memLoad( const char* name, void* mem, size_t size)
+{
+    FILE* f;
+
+    if ( *name && ( f = fopen( name, "rb")))
+    {
+        if ( fread( mem, 1, size, f) != size)
+            fprintf( stderr, "sim: %s is short, padded blank\n", name);
+        fclose( f);
+    }
+}
+
+static void memSave( const char* name, const void* mem, size_t size)
+{
+    FILE* f;
+
+    if ( *name && ( f = fopen( name, "wb")))
+    {
+        fwrite( mem, 1, size, f);
+        fclose( f);
+    }
+}
+
+static void nodeLoad( node_t* n)
+{
+    unsigned i;
+
+    for( i=0; i<FLASH_WORDS; i++)
+        n->flash[i] = FLASH_BLANK;
+    memset( n->eeprom, EEPROM_BLANK, EEPROM_SIZE);
+    memLoad( n->flashFile, n->flash, FLASH_WORDS * sizeof( uint16_t));
+    memLoad( n->eepromFile, n->eeprom, EEPROM_SIZE);
+}
+
+static void nodeSave( node_t* n)
+{
+    memSave( n->flashFile, n->flash, FLASH_WORDS * sizeof( uint16_t));
+    memSave( n->eepromFile, n->eeprom, EEPROM_SIZE);
+}
+
+void sim_unlock( void)
+{
+    unsigned add = EEADR & ( FLASH_WORDS-1);
+    unsigned row = add & ~( FLASH_ROWSIZE-1);
+    unsigned i;
+
+    rxIdle = 0;                     // the firmware is busy
+
+    if ( !EECON1bits.WREN || EECON1bits.CFGS)
+        return;                     // config writes not modeled here
+
+    if ( !EECON1bits.EEPGD)
+    {   // data EEPROM byte, erase and write, WR set until done
+        eeprom[ EEADR & ( EEPROM_SIZE-1)] = EEDAT;
+        EECON1bits.WR = ( eepromWrite > 0);
+        eepromDone = cpuNow() + eepromWrite;
+        return;
+    }
+
+    if ( EECON1bits.FREE)
+    {   // row erase
+        for( i=0; i<FLASH_ROWSIZE; i++)
+            flash[ row+i] = FLASH_BLANK;
+        stall( eraseStall);
+        return;
+    }
+
+    latch[ add & ( FLASH_ROWSIZE-1)] = EEDAT & FLASH_BLANK;
+    if ( EECON1bits.LWLO)
+        return;                     // latch only
+
+    // write the row, programming can only clear bits
+    for( i=0; i<FLASH_ROWSIZE; i++)
+    {
+        flash[ row+i] &= latch[i];
+        latch[i] = FLASH_BLANK;
+    }
+    stall( writeStall);
+}
+
+EECON1bits_t* sim_EECON1( void)
+{
+    if ( sim_eecon1.WR && ( cpuNow() >= eepromDone))
+        sim_eecon1.WR = 0;
+    else if ( sim_eecon1.WR)
+    {   // polled, let the host run, no idle sleep overshooting the write
+        rxIdle = 0;
+        sched_yield();
+        rxFill( 0);
+        if ( !rxPolled)             // busy wait, the receiver left alone
+            rxOverrun( cpu);
+    }
+    rxPolled = 0;
+    return &sim_eecon1;
+}
+
+void sim_nop( void)
+{
+    rxIdle = 0;                     // the firmware is busy
+    if ( !EECON1bits.RD)
+        return;
+    EECON1bits.RD = 0;
+
+    if ( EECON1bits.CFGS)
+        EEDAT = ( EEADR == 0x06) ? 0x2A00 : FLASH_BLANK;  // device ID
+    else if ( EECON1bits.EEPGD)
+        EEDAT = flash[ EEADR & ( FLASH_WORDS-1)];
+    else
+        EEDAT = eeprom[ EEADR & ( EEPROM_SIZE-1)];
+}
+
+/******************************************************************************
+ * EUSART
+ *  bytes are paced at the baud rate programmed in SP1BRG, a host port set
+ *  to a different rate (more than 4% off) or frame (parity bit vs 9-bit
+ *  mode) sees garbage and causes FERR
+ *  the 9th bit is the host parity, mark or space, when the bytes arrive
+ */
+#define BUS_PACKET      64          // bytes per bus packet, after the 9th bit
+
+static double devBaud( void)
+{
+    return FOSC / 4.0 / (( SP1BRGL | SP1BRGH << 8) + 1);  // BRG16 and BRGH
+}
+
+static int mismatch( int nine)
+{
+    struct termios2 t;
+    double d = devBaud();
+
+    if ( ioctl( slave, TCGETS2, &t))
+        return 0;
+    return ( t.c_ospeed < d * 0.96) || ( t.c_ospeed > d * 1.04)
+        || ( !( t.c_cflag & ( PARENB | CMSPAR)) != !nine);
+}
+
+/*
+ * the pty clears PARENB, mark/space (stick) parity is still seen as CMSPAR
+ * with or without PARODD
+ */
+static int hostBit9( void)
+{
+    struct termios2 t;
+
+    if ( ioctl( slave, TCGETS2, &t))
+        return 0;
+    return ( t.c_cflag & ( CMSPAR | PARODD)) == ( CMSPAR | PARODD);
+}
+
+static void txFlush( void)
+{
+    double t = now();
+    double bt = ( sim_tx1sta.bits.TX9 ? 11 : 10) / devBaud();
+
+    if ( !txPending)
+        return;
+    txPending = 0;
+    if ( mismatch( sim_tx1sta.bits.TX9))
+        txReg ^= 0x5A;              // host samples at the wrong rate
+    if ( write( port, &txReg, 1) != 1)
+        perror( "sim: tx");
+
+    // TXREG moves to the shift register as soon as it is free, a short
+    // descheduling of the simulator is made up rather than lost
+    txFree = ( tsrDone > t - SLACK) ? tsrDone : t;
+    tsrDone = txFree + bt;
+}
+
+static void rxFill( double timeout)
+{
+    struct pollfd p = { port, POLLIN, 0 };
+    struct timespec ts = { 0, timeout * 1e9 };
+    uint8_t buf[ BUS_PACKET + 1];
+    uint8_t* data = buf;
+    unsigned room = sizeof( rxq) - ( rxTail - rxHead);
+    double bt = ( sim_rc1sta.bits.RX9 ? 11 : 10) / devBaud();
+    double t;
+    int n, i, bad, nine;
+
+    if ( room > BUS_PACKET)
+        room = BUS_PACKET;
+    if (( nodeCount > 1) && ( room < BUS_PACKET))
+        return;                     // room for a whole bus packet
+    if ( room == 0 || ppoll( &p, 1, &ts, NULL) <= 0)
+        return;                     // the pty buffers the rest
+    if ( nodeCount > 1)
+    {   // bus packet, the 9th bit then the bytes
+        n = read( port, buf, sizeof( buf)) - 1;
+        nine = buf[0];
+        data = buf + 1;
+    }
+    else
+    {
+        n = read( port, buf, room);
+        nine = hostBit9();
+    }
+    bad = mismatch( sim_rc1sta.bits.RX9);
+    t = now();
+    for( i=0; i<n; i++)
+    {   // each byte completes one frame time after the previous one
+        rxLast = (( rxLast > t - SLACK) ? rxLast : t) + bt;
+        rxAt[ rxTail % sizeof( rxq)] = rxLast;
+        rxErr[ rxTail % sizeof( rxq)] = bad;
+        rx9[ rxTail % sizeof( rxq)] = nine;
+        rxq[ rxTail++ % sizeof( rxq)] = bad ? data[i] ^ 0x5A : data[i];
+    }
+}
+
+static void rxMove( unsigned to, unsigned from)
+{
+    rxq[ to % sizeof( rxq)] = rxq[ from % sizeof( rxq)];
+    rxAt[ to % sizeof( rxq)] = rxAt[ from % sizeof( rxq)];
+    rxErr[ to % sizeof( rxq)] = rxErr[ from % sizeof( rxq)];
+    rx9[ to % sizeof( rxq)] = rx9[ from % sizeof( rxq)];
+}
+
+/*
+ * the CPU halts, the bytes completed meanwhile beyond the FIFO are lost
+ */
+static void stall( double s)
+{
+    double end = cpuNow() + s;
+
+    if ( s <= 0)
+        return;
+    txFlush();
+    while( now() < end)
+    {   // timestamp the bytes as they arrive
+        rxFill( 0);
+        sched_yield();
+    }
+    cpu = end;
+    rxOverrun( end);
+}
+
+/*
+ * the receiver was not read up to end, the bytes beyond the FIFO are lost
+ */
+static void rxOverrun( double end)
+{
+    unsigned n;
+
+    for( n=0; ( rxHead + n != rxTail) && ( rxAt[ ( rxHead + n) % sizeof( rxq)] <= end); n++);
+    if ( n > RX_FIFO)
+    {   // keep the first ones, in the FIFO
+        rxMove( rxHead + n - 1, rxHead + 1);
+        rxMove( rxHead + n - 2, rxHead);
+        rxHead += n - RX_FIFO;
+        sim_rc1sta.bits.OERR = 1;
+    }
+}
+
+static int rxReady( void)
+{
+    // address detect, data bytes are ignored until an address selects the node
+    while (( rxHead != rxTail) && ( rxAt[ rxHead % sizeof( rxq)] <= cpu)
+           && sim_rc1sta.bits.RX9 && sim_rc1sta.bits.ADDEN && !rx9[ rxHead % sizeof( rxq)])
+        rxHead++;
+    return ( rxHead != rxTail) && ( rxAt[ rxHead % sizeof( rxq)] <= cpu);
+}
+
+PIR1_t* sim_PIR1( void)
+{
+    double wait = 0;
+
+    txFlush();
+    rxPolled = 1;
+    // sleep only when the firmware is idle waiting for the host, short
+    // waits (a byte on the wire, TXREG busy) spin as the sleep is too coarse,
+    // yielding to the host on a single CPU
+    if ( rxIdle++ > 100)
+    {
+        if (( rxHead == rxTail) && ( txFree <= now()))
+            wait = 0.001;
+        else
+            sched_yield();
+    }
+    rxFill(( wait > 0) ? wait : 0);
+    cpuNow();
+    if ( rxReady())
+        rxIdle = 0;
+
+    sim_pir1.bits.RCIF = rxReady();
+    sim_pir1.bits.TXIF = ( now() >= txFree);
+    sim_TMR1();
+    return &sim_pir1;
+}
+
+uint8_t* sim_RCREG( void)
+{
+    txFlush();
+    if ( rxReady())
+        rxReg = rxq[ rxHead++ % sizeof( rxq)];
+    return &rxReg;
+}
+
+RC1STA_t* sim_RC1STA( void)
+{
+    int ready = rxReady();
+
+    if ( !sim_rc1sta.bits.CREN)
+        sim_rc1sta.bits.OERR = 0;   // receiver reset
+    sim_rc1sta.bits.FERR = ready && rxErr[ rxHead % sizeof( rxq)];
+    sim_rc1sta.bits.RX9D = ready && rx9[ rxHead % sizeof( rxq)];
+    return &sim_rc1sta;
+}
+
+TX1STA_t* sim_TX1STA( void)
+{
+    txFlush();
+    sim_tx1sta.bits.TRMT = ( now() >= tsrDone);
+    return &sim_tx1sta;
+}
+
+uint8_t* sim_TXREG( void)
+{
+    txFlush();
+    txPending = 1;
+    rxIdle = 0;                     // the firmware is busy transmitting
+    return &txReg;
+}
+
+/******************************************************************************
+ * Oscillator
+ */
+OSCSTAT_t* sim_OSCSTAT( void)
+{
+    if ( !( OSCCON & 0x80))
+        pllOn = 0;
+    else if ( pllOn == 0)
+        pllOn = now();
+    sim_oscstat.bits.PLLR = pllOn != 0 && now() - pllOn >= PLL_LOCK;
+    return &sim_oscstat;
+}
+
+/******************************************************************************
+ * TMR0
+ */
+INTCON_t* sim_INTCON( void)
+{
+    double period = 256 * 4 * ( 2 << OPTION_REGbits.PS) / FOSC;   // Fosc/4, prescaler
+    double t = now();
+
+    if ( t - tmr0Last >= period)
+    {
+        sim_intcon.bits.TMR0IF = 1;
+        tmr0Last = t;
+    }
+    return &sim_intcon;
+}
+
+/*
+ * TMR1 on Fosc/4 with its prescaler, counts the firmware time (cpu) so flash
+ * stalls are measured as on the device, whatever the host scheduling
+ */
+uint16_t* sim_TMR1( void)
+{
+    double rate = FOSC / 4 / ( 1 << sim_t1con.bits.T1CKPS);
+    double ticks = ( cpu - tmr1At) * rate;
+
+    if ( !sim_t1con.bits.TMR1ON || ( ticks < 1))
+    {
+        if ( !sim_t1con.bits.TMR1ON)
+            tmr1At = cpu;
+        return &tmr1;
+    }
+    if ( tmr1 + ticks > 0xFFFF)
+        sim_pir1.bits.TMR1IF = 1;
+    tmr1 += ( unsigned long)ticks;
+    tmr1At += ( unsigned long)ticks / rate;
+    return &tmr1;
+}
+
+/******************************************************************************
+ * Reset and application entry
+ */
+void bootLoad( void)
+{
+    txFlush();
+    exit( 0);                       // parent forks a new MCU
+}
+
+void runApp( void)
+{
+    struct pollfd p = { port, POLLIN, 0 };
+    uint8_t buf[ BUS_PACKET + 1];
+
+    txFlush();
+    fprintf( stderr, "sim: run application (Fosc = %.0f MHz), %.0f us after reset\n",
+             FOSC / 1e6, ( now() - resetAt) * 1e6);
+    if ( !RA5)
+        exit( 0);                   // CS held low, back to the bootloader
+
+    // stand-in application: the first bytes received ask for boot mode
+    poll( &p, 1, -1);
+    while( poll( &p, 1, 20) > 0)    // the rest of the wake-up text
+        if ( read( port, buf, sizeof( buf)) <= 0)
+            break;
+    eeprom[ EE_BOOT] = BOOT_REQUEST;
+    fprintf( stderr, "sim: application requests boot mode\n");
+    exit( 0);
+}
+
+static void mcu( node_t* n)
+{
+    signal( SIGINT, SIG_DFL);
+    signal( SIGTERM, SIG_DFL);
+    signal( SIGUSR1, SIG_IGN);      // the parent power cycles
+    flash = n->flash;
+    eeprom = n->eeprom;
+    port = n->port;
+    RA5 = cs;                       // low: stay in the bootloader
+    resetAt = now();
+    tmr0Last = resetAt;
+    firmware_main();
+    exit( 0);
+}
+
+static void reset( node_t* n)
+{
+    n->pid = fork();
+    if ( n->pid == 0)
+        mcu( n);
+}
+
+/*
+ * power cycle (SIGUSR1), the nodes die and restart, see alive()
+ */
+static void power( int sig)
+{
+    int i;
+
+    (void)sig;
+    for( i=0; i<nodeCount; i++)
+        if ( nodes[i].pid > 0)
+            kill( nodes[i].pid, SIGKILL);
+}
+
+/*
+ * a node exited for a reset (0) or a power cycle, not a crash
+ */
+static int alive( int status)
+{
+    if ( WIFSIGNALED( status))
+        return WTERMSIG( status) == SIGKILL;
+    return WIFEXITED( status) && ( WEXITSTATUS( status) == 0);
+}
+
+static void quit( int sig)
+{
+    int i;
+
+    (void)sig;
+    for( i=0; i<nodeCount; i++)
+    {
+        if ( nodes[i].pid > 0)
+            kill( nodes[i].pid, SIGKILL);
+        nodeSave( &nodes[i]);
+    }
+    _exit( 0);
+}
+
+/**
+ * Relay between the host and the nodes on the bus, forever
+ */
+static void bus( void)
+{
+    struct pollfd p[ NODES_MAX + 1];
+    uint8_t buf[ BUS_PACKET + 1];
+    int i, j, n, status;
+    pid_t pid;
+
+    while( 1)
+    {
+        p[0].fd = master;
+        p[0].events = POLLIN;
+        for( i=0; i<nodeCount; i++)
+        {
+            p[i+1].fd = nodes[i].bus;
+            p[i+1].events = POLLIN;
+        }
+        if ( poll( p, nodeCount + 1, 100) > 0)
+        {
+            if (( p[0].revents & POLLIN) && ( n = read( master, buf + 1, BUS_PACKET)) > 0)
+            {   // to every node, with the 9th bit the host is sending now
+                buf[0] = hostBit9();
+                for( i=0; i<nodeCount; i++)
+                    if ( write( nodes[i].bus, buf, n + 1) != n + 1)
+                        perror( "sim: bus");
+            }
+            for( i=0; i<nodeCount; i++)
+            {   // any node drives the line
+                if (( p[i+1].revents & POLLIN) && ( n = read( nodes[i].bus, buf, sizeof( buf))) > 0)
+                    if ( write( master, buf, n) != n)
+                        perror( "sim: tx");
+            }
+        }
+        while(( pid = waitpid( -1, &status, WNOHANG)) > 0)
+        {
+            for( j=0; j<nodeCount; j++)
+            {
+                if ( nodes[j].pid != pid)
+                    continue;
+                nodeSave( &nodes[j]);
+                if ( !alive( status))
+                    quit( 0);
+                reset( &nodes[j]);
+            }
+        }
+    }
+}
+
+int main( int argc, char** argv)
+{
+    const char* link = NULL;
+    const char* flashFile = "";
+    const char* eepromFile = "";
+    int address = -1;
+    struct termios2 t;
+    int opt, status, i, s[2];
+    node_t* n;
+
+    while(( opt = getopt( argc, argv, "l:f:e:n:a:c:E:W:D:")) != -1)
+    {
+        switch( opt){
+            case 'l':   link = optarg;              break;
+            case 'f':   flashFile = optarg;         break;
+            case 'e':   eepromFile = optarg;        break;
+            case 'n':   nodeCount = atoi( optarg);  break;
+            case 'a':   address = strtol( optarg, NULL, 0); break;
+            case 'c':   cs = ( atoi( optarg) != 0); break;
+            case 'E':   eraseStall = atof( optarg) / 1000;  break;
+            case 'W':   writeStall = atof( optarg) / 1000;  break;
+            case 'D':   eepromWrite = atof( optarg) / 1000; break;
+            default:
+                nodeCount = 0;
+                break;
+        }
+    }
+    if ( nodeCount < 1 || nodeCount > NODES_MAX)
+    {
+        fprintf( stderr, "Usage: %s [-l link] [-f flash.bin] [-e eeprom.bin] "
+                         "[-n nodes] [-a address] [-c cs] [-E erase_ms] [-W write_ms] [-D eeprom_ms]\n", argv[0]);
+        return 1;
+    }
+
+    for( i=0; i<nodeCount; i++)
+    {
+        n = &nodes[i];
+        n->flash = mmap( NULL, FLASH_WORDS * sizeof( uint16_t) + EEPROM_SIZE,
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if ( n->flash == MAP_FAILED)
+        {
+            perror( "sim: mmap");
+            return 1;
+        }
+        n->eeprom = ( uint8_t*)( n->flash + FLASH_WORDS);
+        if ( nodeCount > 1)
+        {
+            snprintf( n->flashFile, sizeof( n->flashFile), *flashFile ? "%s.%d" : "", flashFile, i+1);
+            snprintf( n->eepromFile, sizeof( n->eepromFile), *eepromFile ? "%s.%d" : "", eepromFile, i+1);
+        }
+        else
+        {
+            snprintf( n->flashFile, sizeof( n->flashFile), "%s", flashFile);
+            snprintf( n->eepromFile, sizeof( n->eepromFile), "%s", eepromFile);
+        }
+        nodeLoad( n);
+        if ( address >= 0)
+            n->eeprom[ EE_NODE] = address + i;
+    }
+
+    // open a raw pty, keep the slave open so the master never sees a hangup
+    master = posix_openpt( O_RDWR | O_NOCTTY);
+    if ( master < 0 || grantpt( master) || unlockpt( master))
+    {
+        perror( "sim: pty");
+        return 1;
+    }
+    slave = open( ptsname( master), O_RDWR | O_NOCTTY);
+    ioctl( slave, TCGETS2, &t);
+    t.c_iflag &= ~( IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~( ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~( CSIZE | PARENB | CBAUD);
+    t.c_cflag |= CS8 | BOTHER;
+    t.c_ispeed = t.c_ospeed = 19200;
+    ioctl( slave, TCSETS2, &t);
+
+    printf( "%s\n", ptsname( master));
+    fflush( stdout);
+    if ( link)
+    {
+        unlink( link);
+        if ( symlink( ptsname( master), link))
+            perror( "sim: link");
+    }
+
+    signal( SIGINT, quit);
+    signal( SIGTERM, quit);
+    signal( SIGUSR1, power);
+
+    // every reset runs the firmware again from a clean process
+    if ( nodeCount > 1)
+    {   // each node on a link to the bus
+        for( i=0; i<nodeCount; i++)
+        {
+            if ( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, s))
+            {
+                perror( "sim: socketpair");
+                return 1;
+            }
+            nodes[i].bus = s[0];
+            nodes[i].port = s[1];
+            reset( &nodes[i]);
+        }
+        bus();
+    }
+
+    nodes[0].port = master;
+    while( 1)
+    {
+        reset( &nodes[0]);
+        waitpid( nodes[0].pid, &status, 0);
+        nodeSave( &nodes[0]);
+        if ( !alive( status))
+            break;
+    }
+    return 1;
+}
@@ -0,0 +1,19 @@
+/*
+ * File: sim/sim.h
+ *
+ * Host build replacements for the bootloader entry/exit points
+ */
+#ifndef SIM_H
+#define SIM_H
+
+/**
+ * Restart the bootloader (MCU reset)
+ */
+void    bootLoad( void);
+
+/**
+ * Jump to the application, the simulator logs it and resets the MCU
+ */
+void    runApp( void);
+
+#endif // SIM_H
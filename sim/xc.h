@@ -0,0 +1,141 @@
+/*
+ * File: sim/xc.h
+ *
+ * Host build stand-in for the XC8 device header (PIC16F1783)
+ * only the registers used by the bootloader and the MCC drivers are modeled,
+ * registers with side effects are routed to the simulator (see sim.c)
+ */
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+#include <stdint.h>
+
+/******************************************************************************
+ * Flash self-write
+ */
+typedef struct {
+    unsigned RD:1, WR:1, WREN:1, WRERR:1, FREE:1, LWLO:1, CFGS:1, EEPGD:1;
+} EECON1bits_t;
+
+extern uint16_t     EEADR;
+extern uint16_t     EEDAT;
+extern uint8_t      EECON2;
+
+void     sim_unlock( void);         // replaces the 55/AA/WR unlock sequence
+void     sim_nop( void);            // completes a pending read (RD)
+EECON1bits_t* sim_EECON1( void);    // clears WR when a data EEPROM write is done
+
+#define NOP()       sim_nop()
+#define EECON1bits  (*sim_EECON1())
+
+/******************************************************************************
+ * Interrupts and TMR0
+ */
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned IOCIF:1, INTF:1, TMR0IF:1, IOCIE:1, INTE:1, TMR0IE:1, PEIE:1, GIE:1;
+    } bits;
+} INTCON_t;
+
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned TMR1IF:1, TMR2IF:1, CCP1IF:1, SSP1IF:1, TXIF:1, RCIF:1, ADIF:1, TMR1GIF:1;
+    } bits;
+} PIR1_t;
+
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned PS:3, PSA:1, TMR0SE:1, TMR0CS:1, INTEDG:1, nWPUEN:1;
+    } bits;
+} OPTION_REG_t;
+
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned TMR1ON:1, :1, nT1SYNC:1, T1OSCEN:1, T1CKPS:2, TMR1CS:2;
+    } bits;
+} T1CON_t;
+
+INTCON_t*   sim_INTCON( void);      // updates TMR0IF from the elapsed time
+PIR1_t*     sim_PIR1( void);        // updates RCIF/TXIF from the pty, TMR1IF
+uint16_t*   sim_TMR1( void);        // counts the firmware time (Fosc/4)
+
+extern OPTION_REG_t sim_option;
+extern uint8_t      TMR0;
+extern T1CON_t      sim_t1con;
+
+#define INTCON      (sim_INTCON()->reg)
+#define INTCONbits  (sim_INTCON()->bits)
+#define PIR1        (sim_PIR1()->reg)
+#define PIR1bits    (sim_PIR1()->bits)
+#define OPTION_REG      (sim_option.reg)
+#define OPTION_REGbits  (sim_option.bits)
+#define TMR1        (*sim_TMR1())
+#define T1CON       (sim_t1con.reg)
+#define T1CONbits   (sim_t1con.bits)
+
+/******************************************************************************
+ * Oscillator
+ */
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned HFIOFS:1, LFIOFR:1, MFIOFR:1, HFIOFL:1, HFIOFR:1, OSTS:1, PLLR:1, T1OSCR:1;
+    } bits;
+} OSCSTAT_t;
+
+OSCSTAT_t*  sim_OSCSTAT( void);     // PLLR set PLL_LOCK after SPLLEN
+
+extern uint8_t OSCCON, OSCTUNE;
+
+#define OSCSTAT     (sim_OSCSTAT()->reg)
+#define OSCSTATbits (sim_OSCSTAT()->bits)
+
+/******************************************************************************
+ * EUSART
+ */
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned RX9D:1, OERR:1, FERR:1, ADDEN:1, CREN:1, SREN:1, RX9:1, SPEN:1;
+    } bits;
+} RC1STA_t;
+
+typedef union {
+    uint8_t reg;
+    struct {
+        unsigned TX9D:1, TRMT:1, BRGH:1, SENDB:1, SYNC:1, TXEN:1, TX9:1, CSRC:1;
+    } bits;
+} TX1STA_t;
+
+TX1STA_t*   sim_TX1STA( void);      // updates TRMT
+RC1STA_t*   sim_RC1STA( void);      // updates FERR
+
+extern uint8_t  BAUD1CON, SP1BRGL, SP1BRGH;
+
+uint8_t*    sim_RCREG( void);       // pops the receive FIFO
+uint8_t*    sim_TXREG( void);       // queues a byte for transmission
+
+#define RC1STA      (sim_RC1STA()->reg)
+#define RC1STAbits  (sim_RC1STA()->bits)
+#define TX1STA      (sim_TX1STA()->reg)
+#define TX1STAbits  (sim_TX1STA()->bits)
+#define RC1REG      (*sim_RCREG())
+#define RCREG       (*sim_RCREG())
+#define TX1REG      (*sim_TXREG())
+#define TXREG       (*sim_TXREG())
+
+/******************************************************************************
+ * I/O ports
+ */
+extern uint8_t LATA, LATB, LATC;
+extern uint8_t TRISA, TRISB, TRISC, TRISE;
+extern uint8_t ANSELA, ANSELB;
+extern uint8_t WPUA, WPUB, WPUC, WPUE;
+extern uint8_t APFCON;
+extern uint8_t RA5, RA7, LATA5, LATA7;
+
+#endif // SIM_XC_H